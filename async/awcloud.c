@@ -6,7 +6,9 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/poll.h>
+#include <linux/ktime.h>
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
 #include <linux/device.h>
@@ -14,6 +16,18 @@
 #include <linux/sched/signal.h>
 #endif
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+/*
+ * Debug messages, off unless enabled through dynamic debug and rate
+ * limited when on. Each one starts with its category (io, seek, ioctl)
+ * so a category can be switched on by itself, e.g.
+ *   echo 'module awcloud format "io: " +p' > /proc/dynamic_debug/control
+ */
+#define awcloud_dbg(cat, fmt, ...) \
+	pr_debug_ratelimited(cat ": " fmt, ##__VA_ARGS__)
+
 #define DEV_NAME "awcloud"
 #define BUFFER_LEN 4096
 #define MEM_CLEAR 0x1
@@ -48,6 +62,9 @@ static int fasync_awcloud_async(int fd, struct file *filp, int on)
 static int open_awcloud_async(struct inode *inodep, struct file *filp)
 {
 	filp->private_data = dev;
+#ifdef FMODE_NOWAIT
+	filp->f_mode |= FMODE_NOWAIT;
+#endif
 	return 0;
 }
 
@@ -57,29 +74,39 @@ static int release_awcloud_async(struct inode *inodep, struct file *filp)
 	return 0;
 }
 
-static ssize_t read_awcloud_async(struct file *filp,
-	char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t awcloud_async_read(struct kiocb *iocb, struct iov_iter *to)
 {
-	int ret = 0;
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(to);
+	struct file *filp = iocb->ki_filp;
 	struct awcloud_async *dev = (struct awcloud_async *)filp->private_data;
+	unsigned int minor = iminor(file_inode(filp));
+	u64 since;
+	int result;
 
-	DECLARE_WAITQUEUE(wait, current);
-
-	down(&dev->sem);
-	add_wait_queue(&dev->r_wait, &wait);
-
-	if (0 == dev->used_len) {
-		if (filp->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			goto again_err;
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (down_trylock(&dev->sem)) {
+			return -EAGAIN;
 		}
-		__set_current_state(TASK_INTERRUPTIBLE);
+	} else {
+		down(&dev->sem);
+	}
+	while (0 == dev->used_len) {
 		up(&dev->sem);
-		schedule();
-
-		if (signal_pending(current)) {
-			ret = -ERESTARTSYS;
-			goto out;
+		if ((filp->f_flags & O_NONBLOCK) ||
+			(iocb->ki_flags & IOCB_NOWAIT)) {
+			return -EAGAIN;
+		}
+		/*
+		 * Exclusive wait: one writer wakes one reader instead of the
+		 * whole queue, and the condition is rechecked under the lock.
+		 */
+		since = trace_awcloud_wait_enabled() ? ktime_get_ns() : 0;
+		result = wait_event_interruptible_exclusive(dev->r_wait,
+			dev->used_len);
+		trace_awcloud_wait(minor, false, since, result);
+		if (result) {
+			return -ERESTARTSYS;
 		}
 		down(&dev->sem);
 	}
@@ -88,65 +115,79 @@ static ssize_t read_awcloud_async(struct file *filp,
 		count = dev->used_len;
 	}
 
-	if (copy_to_user(user_buffer, dev->buffer, count)) {
+	if (copy_to_iter(dev->buffer, count, to) != count) {
 		ret = -EFAULT;
 		goto copy_to_user_err;
 	}
 
 	//memcpy(dev->buffer, dev->buffer+count, dev->used_len-count);
 	dev->used_len -= count;
-#if defined(__arm__)
-	pr_info("Read %d bytes, current lenth is %d\n", count, dev->used_len);
-#else
-	pr_info("Read %ld bytes, current lenth is %d\n", count, dev->used_len);
-#endif
-	wake_up_interruptible(&dev->w_wait);
+	awcloud_dbg("io", "read %zu bytes, %u left\n", count, dev->used_len);
+	trace_awcloud_wakeup(minor, AWCLOUD_WAKE_READ, POLLOUT | POLLWRNORM);
+	wake_up_interruptible_poll(&dev->w_wait, POLLOUT | POLLWRNORM);
+	if (dev->used_len) {
+		/* Hand the wakeup on to the next reader */
+		trace_awcloud_wakeup(minor, AWCLOUD_WAKE_READ,
+			POLLIN | POLLRDNORM);
+		wake_up_interruptible_poll(&dev->r_wait, POLLIN | POLLRDNORM);
+	}
 	if (dev->async_queue) {
 		kill_fasync(&dev->async_queue, SIGIO, POLL_OUT);
-		pr_debug("%s kill SIGIO", __func__);
+		awcloud_dbg("io", "%s kill SIGIO\n", __func__);
 	}
 	ret = count;
 
-again_err:
 copy_to_user_err:
 	up(&dev->sem);
 
-out:
-	remove_wait_queue(&dev->r_wait, &wait);
-	set_current_state(TASK_RUNNING);
-
 	return ret;
 }
 
-static ssize_t write_awcloud_async(struct file *filp,
-	const char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t read_iter_awcloud_async(struct kiocb *iocb, struct iov_iter *to)
 {
-	int ret = 0;
+	struct file *filp = iocb->ki_filp;
 	struct awcloud_async *dev = (struct awcloud_async *)filp->private_data;
-	DECLARE_WAITQUEUE(wait, current);
+	unsigned int minor = iminor(file_inode(filp));
+	ssize_t ret;
 
-	pr_info(
-#if defined(__arm__)
-		"Calling the write function with count %d, and ppos %lld\n",
-#else
-		"Calling the write function with count %ld, and ppos %lld\n",
-#endif
-		count, *ppos);
+	trace_awcloud_read_enter(minor, iov_iter_count(to), iocb->ki_pos);
+	ret = awcloud_async_read(iocb, to);
+	trace_awcloud_read_exit(minor, ret, dev->used_len);
 
-	down(&dev->sem);
-	add_wait_queue(&dev->w_wait, &wait);
+	return ret;
+}
+
+static ssize_t awcloud_async_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(from);
+	struct file *filp = iocb->ki_filp;
+	struct awcloud_async *dev = (struct awcloud_async *)filp->private_data;
+	unsigned int minor = iminor(file_inode(filp));
+	u64 since;
+	int result;
 
-	if (BUFFER_LEN == dev->used_len) {
-		if (filp->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			goto again_err;
+	awcloud_dbg("io", "write %zu bytes at %lld\n", count, iocb->ki_pos);
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (down_trylock(&dev->sem)) {
+			return -EAGAIN;
 		}
-		__set_current_state(TASK_INTERRUPTIBLE);
+	} else {
+		down(&dev->sem);
+	}
+	while (BUFFER_LEN == dev->used_len) {
 		up(&dev->sem);
-		schedule();
-		if (signal_pending(current)) {
-			ret = -ERESTARTSYS;
-			goto out;
+		if ((filp->f_flags & O_NONBLOCK) ||
+			(iocb->ki_flags & IOCB_NOWAIT)) {
+			return -EAGAIN;
+		}
+		since = trace_awcloud_wait_enabled() ? ktime_get_ns() : 0;
+		result = wait_event_interruptible_exclusive(dev->w_wait,
+			BUFFER_LEN != dev->used_len);
+		trace_awcloud_wait(minor, true, since, result);
+		if (result) {
+			return -ERESTARTSYS;
 		}
 		down(&dev->sem);
 	}
@@ -155,41 +196,50 @@ static ssize_t write_awcloud_async(struct file *filp,
 		count = BUFFER_LEN - dev->used_len;
 	}
 
-	if (copy_from_user(dev->buffer+dev->used_len, user_buffer, count)) {
+	if (copy_from_iter(dev->buffer+dev->used_len, count, from) != count) {
 		ret = -EFAULT;
 		goto copy_from_user_err;
 	}
 
 	dev->used_len += count;
-	wake_up_interruptible(&dev->r_wait);
+	trace_awcloud_wakeup(minor, AWCLOUD_WAKE_WRITE, POLLIN | POLLRDNORM);
+	wake_up_interruptible_poll(&dev->r_wait, POLLIN | POLLRDNORM);
+	if (BUFFER_LEN != dev->used_len) {
+		trace_awcloud_wakeup(minor, AWCLOUD_WAKE_WRITE,
+			POLLOUT | POLLWRNORM);
+		wake_up_interruptible_poll(&dev->w_wait, POLLOUT | POLLWRNORM);
+	}
 	ret = count;
 
 	if (dev->async_queue) {
 		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
-		pr_debug("%s kill SIGIO", __func__);
+		awcloud_dbg("io", "%s kill SIGIO\n", __func__);
 	}
 
-again_err:
 copy_from_user_err:
 	up(&dev->sem);
 
-out:
-	remove_wait_queue(&dev->w_wait, &wait);
-	set_current_state(TASK_RUNNING);
-
 	return ret;
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
-int ioctl_awcloud_async(struct inode *inodep,
-	struct file *filp, unsigned int cmd, unsigned long arg)
+static ssize_t write_iter_awcloud_async(struct kiocb *iocb,
+	struct iov_iter *from)
 {
-#else
-static long ioctl_awcloud_async(struct file *filp,
-	unsigned int cmd, unsigned long arg)
+	struct file *filp = iocb->ki_filp;
+	struct awcloud_async *dev = (struct awcloud_async *)filp->private_data;
+	unsigned int minor = iminor(file_inode(filp));
+	ssize_t ret;
+
+	trace_awcloud_write_enter(minor, iov_iter_count(from), iocb->ki_pos);
+	ret = awcloud_async_write(iocb, from);
+	trace_awcloud_write_exit(minor, ret, dev->used_len);
+
+	return ret;
+}
+
+static long awcloud_async_ioctl(struct file *filp, unsigned int cmd,
+	unsigned long arg)
 {
-	//struct inode *inodep = file_inode(filp);
-#endif
 	struct awcloud_async *dev = (struct awcloud_async *)filp->private_data;
 
 	switch (cmd) {
@@ -203,7 +253,7 @@ static long ioctl_awcloud_async(struct file *filp,
 
 		up(&dev->sem);
 
-		pr_info("Set Kernel Buffer to Zero\n");
+		awcloud_dbg("ioctl", "buffer cleared\n");
 		break;
 	default:
 		return -EINVAL;
@@ -211,15 +261,26 @@ static long ioctl_awcloud_async(struct file *filp,
 	return 0;
 }
 
+static long ioctl_awcloud_async(struct file *filp,
+	unsigned int cmd, unsigned long arg)
+{
+	unsigned int minor = iminor(file_inode(filp));
+	long ret;
+
+	trace_awcloud_ioctl_enter(minor, cmd, arg);
+	ret = awcloud_async_ioctl(filp, cmd, arg);
+	trace_awcloud_ioctl_exit(minor, cmd, ret);
+
+	return ret;
+}
+
 static loff_t llseek_awcloud_async(struct file *filp,
 	loff_t offset, int whence)
 {
 	loff_t ret = 0;
 	struct awcloud_async *dev = (struct awcloud_async *)filp->private_data;
 
-	pr_info(
-		"Calling the llseek function of this device,"
-		"and offset is %lld , whence is %d\n", offset, whence);
+	awcloud_dbg("seek", "offset %lld whence %d\n", offset, whence);
 	switch (whence) {
 	case SEEK_SET:
 		if (offset < 0) {
@@ -291,6 +352,8 @@ __poll_t poll_awcloud_async(
 	if (BUFFER_LEN != dev->used_len) {
 		mask |= POLLOUT | POLLWRNORM;
 	}
+	trace_awcloud_poll(iminor(file_inode(filp)),
+		(__force unsigned int)mask, dev->used_len);
 	up(&dev->sem);
 
 	return mask;
@@ -300,17 +363,13 @@ static const struct file_operations awcloud_async_fops = {
 	.owner          = THIS_MODULE,
 	.open           = open_awcloud_async,
 	.release        = release_awcloud_async,
-	.read           = read_awcloud_async,
-	.write          = write_awcloud_async,
+	.read_iter      = read_iter_awcloud_async,
+	.write_iter     = write_iter_awcloud_async,
 	.llseek         = llseek_awcloud_async,
 	.poll           = poll_awcloud_async,
 	.fasync         = fasync_awcloud_async,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 0)
-	.ioctl          = ioctl_awcloud_async,
-#else
 	.compat_ioctl   = ioctl_awcloud_async,
 	.unlocked_ioctl = ioctl_awcloud_async,
-#endif
 };
 
 static int awcloud_async_setup_chrdev(struct awcloud_async *dev)
@@ -365,11 +424,7 @@ static int awcloud_async_setup_chrdev(struct awcloud_async *dev)
 
 	memset(dev->buffer, 0, BUFFER_LEN);
 	dev->used_len = 0;
-#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 36) && !defined(init_MUTEX)
 	sema_init(&(dev->sem), 1);
-#else
-	init_MUTEX(&(dev->sem));
-#endif
 
 	init_waitqueue_head(&dev->r_wait);
 	init_waitqueue_head(&dev->w_wait);
@@ -0,0 +1,208 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM awcloud_async
+
+#if !defined(_AWCLOUD_ASYNC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AWCLOUD_ASYNC_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/ktime.h>
+
+/* Where a wakeup came from, recorded by awcloud_wakeup */
+#ifndef AWCLOUD_WAKE_READ
+#define AWCLOUD_WAKE_READ   0
+#define AWCLOUD_WAKE_WRITE  1
+#endif
+
+DECLARE_EVENT_CLASS(awcloud_io_enter,
+
+	TP_PROTO(unsigned int minor, size_t count, loff_t pos),
+
+	TP_ARGS(minor, count, pos),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(size_t, count)
+		__field(loff_t, pos)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->count = count;
+		__entry->pos = pos;
+	),
+
+	TP_printk("minor=%u count=%zu pos=%lld",
+		__entry->minor, __entry->count, __entry->pos)
+);
+
+DECLARE_EVENT_CLASS(awcloud_io_exit,
+
+	TP_PROTO(unsigned int minor, ssize_t ret, size_t used_len),
+
+	TP_ARGS(minor, ret, used_len),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(ssize_t, ret)
+		__field(size_t, used_len)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->ret = ret;
+		__entry->used_len = used_len;
+	),
+
+	TP_printk("minor=%u ret=%zd used_len=%zu",
+		__entry->minor, __entry->ret, __entry->used_len)
+);
+
+DEFINE_EVENT(awcloud_io_enter, awcloud_read_enter,
+	TP_PROTO(unsigned int minor, size_t count, loff_t pos),
+	TP_ARGS(minor, count, pos)
+);
+
+DEFINE_EVENT(awcloud_io_exit, awcloud_read_exit,
+	TP_PROTO(unsigned int minor, ssize_t ret, size_t used_len),
+	TP_ARGS(minor, ret, used_len)
+);
+
+DEFINE_EVENT(awcloud_io_enter, awcloud_write_enter,
+	TP_PROTO(unsigned int minor, size_t count, loff_t pos),
+	TP_ARGS(minor, count, pos)
+);
+
+DEFINE_EVENT(awcloud_io_exit, awcloud_write_exit,
+	TP_PROTO(unsigned int minor, ssize_t ret, size_t used_len),
+	TP_ARGS(minor, ret, used_len)
+);
+
+TRACE_EVENT(awcloud_ioctl_enter,
+
+	TP_PROTO(unsigned int minor, unsigned int cmd, unsigned long arg),
+
+	TP_ARGS(minor, cmd, arg),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, cmd)
+		__field(unsigned long, arg)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->cmd = cmd;
+		__entry->arg = arg;
+	),
+
+	TP_printk("minor=%u cmd=0x%x arg=0x%lx",
+		__entry->minor, __entry->cmd, __entry->arg)
+);
+
+TRACE_EVENT(awcloud_ioctl_exit,
+
+	TP_PROTO(unsigned int minor, unsigned int cmd, long ret),
+
+	TP_ARGS(minor, cmd, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, cmd)
+		__field(long, ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->cmd = cmd;
+		__entry->ret = ret;
+	),
+
+	TP_printk("minor=%u cmd=0x%x ret=%ld",
+		__entry->minor, __entry->cmd, __entry->ret)
+);
+
+TRACE_EVENT(awcloud_poll,
+
+	TP_PROTO(unsigned int minor, unsigned int mask, size_t used_len),
+
+	TP_ARGS(minor, mask, used_len),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, mask)
+		__field(size_t, used_len)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->mask = mask;
+		__entry->used_len = used_len;
+	),
+
+	TP_printk("minor=%u mask=0x%x used_len=%zu",
+		__entry->minor, __entry->mask, __entry->used_len)
+);
+
+/*
+ * since is the ktime_get_ns() stamp taken before blocking, or 0 if the
+ * event was off at the time; it is only turned into a duration here so
+ * the clock is not read while tracing is off.
+ */
+TRACE_EVENT(awcloud_wait,
+
+	TP_PROTO(unsigned int minor, bool write, u64 since, int ret),
+
+	TP_ARGS(minor, write, since, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(bool, write)
+		__field(u64, wait_ns)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->write = write;
+		__entry->wait_ns = since ? ktime_get_ns() - since : 0;
+		__entry->ret = ret;
+	),
+
+	TP_printk("minor=%u %s wait_ns=%llu ret=%d",
+		__entry->minor, __entry->write ? "write" : "read",
+		__entry->wait_ns, __entry->ret)
+);
+
+TRACE_EVENT(awcloud_wakeup,
+
+	TP_PROTO(unsigned int minor, int source, unsigned int key),
+
+	TP_ARGS(minor, source, key),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(int, source)
+		__field(unsigned int, key)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->source = source;
+		__entry->key = key;
+	),
+
+	TP_printk("minor=%u source=%s key=0x%x", __entry->minor,
+		__print_symbolic(__entry->source,
+			{ AWCLOUD_WAKE_READ,    "read" },
+			{ AWCLOUD_WAKE_WRITE,   "write" }),
+		__entry->key)
+);
+
+#endif /* _AWCLOUD_ASYNC_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+
+#include <trace/define_trace.h>
@@ -6,23 +6,68 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/poll.h>
-
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/idr.h>
+#include <linux/mutex.h>
 #include <linux/device.h>
-#else
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
 #include <linux/sched/signal.h>
 #endif
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+/*
+ * Debug messages, off unless enabled through dynamic debug and rate
+ * limited when on. Each one starts with its category (io, seek, ioctl)
+ * so a category can be switched on by itself, e.g.
+ *   echo 'module awcloud format "io: " +p' > /proc/dynamic_debug/control
+ */
+#define awcloud_dbg(cat, fmt, ...) \
+	pr_debug_ratelimited(cat ": " fmt, ##__VA_ARGS__)
+
 #define DEV_NAME "awcloud"
 #define BUFFER_LEN 4096
 #define MEM_CLEAR 0x1
+#define MAX_DEVICES (MINORMASK + 1)
+
+/*
+ * Per-device counters, one copy per CPU so the I/O path never writes a
+ * cacheline shared with other CPUs. They are only summed up when read
+ * through the stats directory of the device in sysfs.
+ */
+struct awcloud_async_stats {
+	unsigned long bytes_read;
+	unsigned long bytes_written;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long blocked_reads;
+	unsigned long blocked_writes;
+	unsigned long eagain;
+	unsigned long sigio;
+};
 
+#define awcloud_async_stat_add(dev, field, n) \
+	this_cpu_add((dev)->stats->field, n)
+#define awcloud_async_stat_inc(dev, field) \
+	this_cpu_inc((dev)->stats->field)
+
+/*
+ * Every instance is allocated on its own and owned by its struct device:
+ * the release callback frees it once the device is deleted and the last
+ * file opened on it is closed. dead is set when the instance is deleted,
+ * after which every file still open on it gets -ENODEV.
+ */
 struct awcloud_async {
 	unsigned int         used_len;
-	struct device        *device;
-	struct class         *class;
+	bool                 dead;
+	struct device        device;
 	struct fasync_struct *async_queue;
+	struct awcloud_async_stats __percpu *stats;
 	char                 buffer[BUFFER_LEN];
 	struct semaphore     sem;
 	struct cdev          cdev;
@@ -30,17 +75,32 @@ struct awcloud_async {
 	wait_queue_head_t    w_wait;
 };
 
-static struct awcloud_async *dev;
 static unsigned int major;
-static unsigned int num_devices;
+static unsigned int num_devices = 1;
 module_param(major, uint, 0444);
 module_param(num_devices, uint, 0444);
+MODULE_PARM_DESC(num_devices, "Number of instances created at load time");
+
+/*
+ * Minor number to instance. The lock only serializes creating and
+ * deleting instances; I/O never takes it.
+ */
+static DEFINE_IDR(awcloud_async_idr);
+static DEFINE_MUTEX(awcloud_async_lock);
+static struct class *awcloud_async_class;
 
 static int open_awcloud_async(struct inode *inodep, struct file *filp)
 {
 	struct awcloud_async *dev = container_of(
 		inodep->i_cdev, struct awcloud_async, cdev);
+
+	if (READ_ONCE(dev->dead)) {
+		return -ENODEV;
+	}
 	filp->private_data = dev;
+#ifdef FMODE_NOWAIT
+	filp->f_mode |= FMODE_NOWAIT;
+#endif
 	return 0;
 }
 
@@ -58,29 +118,49 @@ static int release_awcloud_async(struct inode *inodep, struct file *filp)
 	return 0;
 }
 
-static ssize_t read_awcloud_async(struct file *filp,
-	char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t awcloud_async_read(struct kiocb *iocb, struct iov_iter *to)
 {
-	int ret = 0;
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(to);
+	struct file *filp = iocb->ki_filp;
 	struct awcloud_async *dev = (struct awcloud_async *)filp->private_data;
+	unsigned int minor = iminor(file_inode(filp));
+	u64 since;
+	int result;
 
-	DECLARE_WAITQUEUE(wait, current);
-
-	down(&dev->sem);
-	add_wait_queue(&dev->r_wait, &wait);
+	if (READ_ONCE(dev->dead)) {
+		return -ENODEV;
+	}
 
-	if (0 == dev->used_len) {
-		if (filp->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			goto again_err;
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (down_trylock(&dev->sem)) {
+			awcloud_async_stat_inc(dev, eagain);
+			return -EAGAIN;
 		}
-		__set_current_state(TASK_INTERRUPTIBLE);
+	} else {
+		down(&dev->sem);
+	}
+	while (0 == dev->used_len) {
 		up(&dev->sem);
-		schedule();
-
-		if (signal_pending(current)) {
-			ret = -ERESTARTSYS;
-			goto out;
+		if (READ_ONCE(dev->dead)) {
+			return -ENODEV;
+		}
+		if ((filp->f_flags & O_NONBLOCK) ||
+			(iocb->ki_flags & IOCB_NOWAIT)) {
+			awcloud_async_stat_inc(dev, eagain);
+			return -EAGAIN;
+		}
+		/*
+		 * Exclusive wait: one writer wakes one reader instead of the
+		 * whole queue, and the condition is rechecked under the lock.
+		 */
+		awcloud_async_stat_inc(dev, blocked_reads);
+		since = trace_awcloud_wait_enabled() ? ktime_get_ns() : 0;
+		result = wait_event_interruptible_exclusive(dev->r_wait,
+			dev->used_len || READ_ONCE(dev->dead));
+		trace_awcloud_wait(minor, false, since, result);
+		if (result) {
+			return -ERESTARTSYS;
 		}
 		down(&dev->sem);
 	}
@@ -89,65 +169,92 @@ static ssize_t read_awcloud_async(struct file *filp,
 		count = dev->used_len;
 	}
 
-	if (copy_to_user(user_buffer, dev->buffer, count)) {
+	if (copy_to_iter(dev->buffer, count, to) != count) {
 		ret = -EFAULT;
 		goto copy_to_user_err;
 	}
 
 	//memcpy(dev->buffer, dev->buffer+count, dev->used_len-count);
 	dev->used_len -= count;
-#if defined(__arm__)
-	pr_info("Read %d bytes, current lenth is %d\n", count, dev->used_len);
-#else
-	pr_info("Read %ld bytes, current lenth is %d\n", count, dev->used_len);
-#endif
-	wake_up_interruptible(&dev->w_wait);
+	awcloud_dbg("io", "read %zu bytes, %u left\n", count, dev->used_len);
+	trace_awcloud_wakeup(minor, AWCLOUD_WAKE_READ, POLLOUT | POLLWRNORM);
+	wake_up_interruptible_poll(&dev->w_wait, POLLOUT | POLLWRNORM);
+	if (dev->used_len) {
+		/* Hand the wakeup on to the next reader */
+		trace_awcloud_wakeup(minor, AWCLOUD_WAKE_READ,
+			POLLIN | POLLRDNORM);
+		wake_up_interruptible_poll(&dev->r_wait, POLLIN | POLLRDNORM);
+	}
 	if (dev->async_queue) {
 		kill_fasync(&dev->async_queue, SIGIO, POLL_OUT);
-		pr_debug("%s kill SIGIO", __func__);
+		awcloud_async_stat_inc(dev, sigio);
+		awcloud_dbg("io", "%s kill SIGIO\n", __func__);
 	}
+	awcloud_async_stat_inc(dev, reads);
+	awcloud_async_stat_add(dev, bytes_read, count);
 	ret = count;
 
-again_err:
 copy_to_user_err:
 	up(&dev->sem);
 
-out:
-	remove_wait_queue(&dev->r_wait, &wait);
-	set_current_state(TASK_RUNNING);
+	return ret;
+}
+
+static ssize_t read_iter_awcloud_async(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	struct awcloud_async *dev = (struct awcloud_async *)filp->private_data;
+	unsigned int minor = iminor(file_inode(filp));
+	ssize_t ret;
+
+	trace_awcloud_read_enter(minor, iov_iter_count(to), iocb->ki_pos);
+	ret = awcloud_async_read(iocb, to);
+	trace_awcloud_read_exit(minor, ret, dev->used_len);
 
 	return ret;
 }
 
-static ssize_t write_awcloud_async(struct file *filp,
-	const char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t awcloud_async_write(struct kiocb *iocb, struct iov_iter *from)
 {
-	int ret = 0;
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(from);
+	struct file *filp = iocb->ki_filp;
 	struct awcloud_async *dev = (struct awcloud_async *)filp->private_data;
-	DECLARE_WAITQUEUE(wait, current);
+	unsigned int minor = iminor(file_inode(filp));
+	u64 since;
+	int result;
 
-	pr_info(
-#if defined(__arm__)
-		"Calling the write function with count %d, and ppos %lld\n",
-#else
-		"Calling the write function with count %ld, and ppos %lld\n",
-#endif
-		count, *ppos);
+	if (READ_ONCE(dev->dead)) {
+		return -ENODEV;
+	}
 
-	down(&dev->sem);
-	add_wait_queue(&dev->w_wait, &wait);
+	awcloud_dbg("io", "write %zu bytes at %lld\n", count, iocb->ki_pos);
 
-	if (BUFFER_LEN == dev->used_len) {
-		if (filp->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			goto again_err;
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (down_trylock(&dev->sem)) {
+			awcloud_async_stat_inc(dev, eagain);
+			return -EAGAIN;
 		}
-		__set_current_state(TASK_INTERRUPTIBLE);
+	} else {
+		down(&dev->sem);
+	}
+	while (BUFFER_LEN == dev->used_len) {
 		up(&dev->sem);
-		schedule();
-		if (signal_pending(current)) {
-			ret = -ERESTARTSYS;
-			goto out;
+		if (READ_ONCE(dev->dead)) {
+			return -ENODEV;
+		}
+		if ((filp->f_flags & O_NONBLOCK) ||
+			(iocb->ki_flags & IOCB_NOWAIT)) {
+			awcloud_async_stat_inc(dev, eagain);
+			return -EAGAIN;
+		}
+		awcloud_async_stat_inc(dev, blocked_writes);
+		since = trace_awcloud_wait_enabled() ? ktime_get_ns() : 0;
+		result = wait_event_interruptible_exclusive(dev->w_wait,
+			BUFFER_LEN != dev->used_len || READ_ONCE(dev->dead));
+		trace_awcloud_wait(minor, true, since, result);
+		if (result) {
+			return -ERESTARTSYS;
 		}
 		down(&dev->sem);
 	}
@@ -156,44 +263,60 @@ static ssize_t write_awcloud_async(struct file *filp,
 		count = BUFFER_LEN - dev->used_len;
 	}
 
-	if (copy_from_user(dev->buffer+dev->used_len, user_buffer, count)) {
+	if (copy_from_iter(dev->buffer+dev->used_len, count, from) != count) {
 		ret = -EFAULT;
 		goto copy_from_user_err;
 	}
 
 	dev->used_len += count;
-	wake_up_interruptible(&dev->r_wait);
+	trace_awcloud_wakeup(minor, AWCLOUD_WAKE_WRITE, POLLIN | POLLRDNORM);
+	wake_up_interruptible_poll(&dev->r_wait, POLLIN | POLLRDNORM);
+	if (BUFFER_LEN != dev->used_len) {
+		trace_awcloud_wakeup(minor, AWCLOUD_WAKE_WRITE,
+			POLLOUT | POLLWRNORM);
+		wake_up_interruptible_poll(&dev->w_wait, POLLOUT | POLLWRNORM);
+	}
+	awcloud_async_stat_inc(dev, writes);
+	awcloud_async_stat_add(dev, bytes_written, count);
 	ret = count;
 
 	if (dev->async_queue) {
 		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
-		pr_debug("%s kill SIGIO", __func__);
+		awcloud_async_stat_inc(dev, sigio);
+		awcloud_dbg("io", "%s kill SIGIO\n", __func__);
 	}
 
-again_err:
 copy_from_user_err:
 	up(&dev->sem);
 
-out:
-	remove_wait_queue(&dev->w_wait, &wait);
-	set_current_state(TASK_RUNNING);
-
 	return ret;
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
-int ioctl_awcloud_async(struct inode *inodep,
-	struct file *filp, unsigned int cmd, unsigned long arg)
+static ssize_t write_iter_awcloud_async(struct kiocb *iocb,
+	struct iov_iter *from)
 {
-#else
-static long ioctl_awcloud_async(struct file *filp,
-	unsigned int cmd, unsigned long arg)
+	struct file *filp = iocb->ki_filp;
+	struct awcloud_async *dev = (struct awcloud_async *)filp->private_data;
+	unsigned int minor = iminor(file_inode(filp));
+	ssize_t ret;
+
+	trace_awcloud_write_enter(minor, iov_iter_count(from), iocb->ki_pos);
+	ret = awcloud_async_write(iocb, from);
+	trace_awcloud_write_exit(minor, ret, dev->used_len);
+
+	return ret;
+}
+
+static long awcloud_async_ioctl(struct file *filp, unsigned int cmd,
+	unsigned long arg)
 {
-	//struct inode *inodep = file_inode(filp);
-#endif
 	struct awcloud_async *dev = (struct awcloud_async *)filp->private_data;
 
-	pr_info("Calling the ioctl function\n");
+	if (READ_ONCE(dev->dead)) {
+		return -ENODEV;
+	}
+
+	awcloud_dbg("ioctl", "cmd 0x%x\n", cmd);
 	switch (cmd) {
 	case MEM_CLEAR:
 		if (down_interruptible(&dev->sem)) {
@@ -205,7 +328,7 @@ static long ioctl_awcloud_async(struct file *filp,
 
 		up(&dev->sem);
 
-		pr_info("Set Kernel Buffer to Zero\n");
+		awcloud_dbg("ioctl", "buffer cleared\n");
 		break;
 	default:
 		return -EINVAL;
@@ -213,15 +336,26 @@ static long ioctl_awcloud_async(struct file *filp,
 	return 0;
 }
 
+static long ioctl_awcloud_async(struct file *filp,
+	unsigned int cmd, unsigned long arg)
+{
+	unsigned int minor = iminor(file_inode(filp));
+	long ret;
+
+	trace_awcloud_ioctl_enter(minor, cmd, arg);
+	ret = awcloud_async_ioctl(filp, cmd, arg);
+	trace_awcloud_ioctl_exit(minor, cmd, ret);
+
+	return ret;
+}
+
 static loff_t llseek_awcloud_async(struct file *filp,
 	loff_t offset, int whence)
 {
 	loff_t ret = 0;
 	struct awcloud_async *dev = (struct awcloud_async *)filp->private_data;
 
-	pr_info(
-		"Calling the llseek function of this device,"
-		"and offset is %lld , whence is %d\n", offset, whence);
+	awcloud_dbg("seek", "offset %lld whence %d\n", offset, whence);
 	switch (whence) {
 	case SEEK_SET:
 		if (offset < 0) {
@@ -287,12 +421,16 @@ __poll_t poll_awcloud_async(
 	down(&dev->sem);
 	poll_wait(filp, &dev->r_wait, wait);
 	poll_wait(filp, &dev->w_wait, wait);
-	if (dev->used_len) {
+	if (READ_ONCE(dev->dead)) {
+		mask |= POLLERR | POLLHUP;
+	} else if (dev->used_len) {
 		mask |= POLLIN | POLLRDNORM;
 	}
 	if (BUFFER_LEN != dev->used_len) {
 		mask |= POLLOUT | POLLWRNORM;
 	}
+	trace_awcloud_poll(iminor(file_inode(filp)),
+		(__force unsigned int)mask, dev->used_len);
 	up(&dev->sem);
 
 	return mask;
@@ -302,141 +440,321 @@ const static struct file_operations awcloud_async_fops = {
 	.owner          = THIS_MODULE,
 	.open           = open_awcloud_async,
 	.release        = release_awcloud_async,
-	.read           = read_awcloud_async,
-	.write          = write_awcloud_async,
+	.read_iter      = read_iter_awcloud_async,
+	.write_iter     = write_iter_awcloud_async,
 	.llseek         = llseek_awcloud_async,
 	.poll           = poll_awcloud_async,
 	.fasync         = fasync_awcloud_async,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 0)
-	.ioctl          = ioctl_awcloud_async,
-#else
 	.compat_ioctl   = ioctl_awcloud_async,
 	.unlocked_ioctl = ioctl_awcloud_async,
-#endif
 };
 
-static int awcloud_async_setup_chrdev(struct awcloud_async *dev, int index)
+static unsigned long awcloud_async_stat_sum(struct awcloud_async *dev,
+	size_t offset)
 {
-	int result = 0;
-	char device_name[10];
-	dev_t dev_id = MKDEV(major, index);
+	unsigned long sum = 0;
+	int cpu;
 
-	dev->cdev.owner = THIS_MODULE;
-	cdev_init(&dev->cdev, &awcloud_async_fops);
-	if (cdev_add(&dev->cdev, dev_id, 1)) {
-		pr_err("Failed to add char dev into system\n");
-		result = -1;
-		goto cdev_add_err;
+	for_each_possible_cpu(cpu) {
+		sum += *(unsigned long *)((char *)per_cpu_ptr(dev->stats, cpu) +
+			offset);
 	}
 
-	sprintf(device_name, DEV_NAME"%d", index);
-	dev->device = device_create(
-		dev->class, NULL, dev_id, NULL, device_name);
-	if (IS_ERR(dev->device)) {
-		result = -1;
-		goto device_create_err;
+	return sum;
+}
+
+#define AWCLOUD_ASYNC_STAT_ATTR(field)					\
+static ssize_t field##_show(struct device *device,			\
+	struct device_attribute *attr, char *buf)			\
+{									\
+	struct awcloud_async *dev = dev_get_drvdata(device);		\
+	size_t offset = offsetof(struct awcloud_async_stats, field);	\
+									\
+	return sprintf(buf, "%lu\n",					\
+		awcloud_async_stat_sum(dev, offset));			\
+}									\
+static DEVICE_ATTR_RO(field)
+
+AWCLOUD_ASYNC_STAT_ATTR(bytes_read);
+AWCLOUD_ASYNC_STAT_ATTR(bytes_written);
+AWCLOUD_ASYNC_STAT_ATTR(reads);
+AWCLOUD_ASYNC_STAT_ATTR(writes);
+AWCLOUD_ASYNC_STAT_ATTR(blocked_reads);
+AWCLOUD_ASYNC_STAT_ATTR(blocked_writes);
+AWCLOUD_ASYNC_STAT_ATTR(eagain);
+AWCLOUD_ASYNC_STAT_ATTR(sigio);
+
+static ssize_t used_len_show(struct device *device,
+	struct device_attribute *attr, char *buf)
+{
+	struct awcloud_async *dev = dev_get_drvdata(device);
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->used_len));
+}
+static DEVICE_ATTR_RO(used_len);
+
+static struct attribute *awcloud_async_stats_attrs[] = {
+	&dev_attr_bytes_read.attr,
+	&dev_attr_bytes_written.attr,
+	&dev_attr_reads.attr,
+	&dev_attr_writes.attr,
+	&dev_attr_blocked_reads.attr,
+	&dev_attr_blocked_writes.attr,
+	&dev_attr_eagain.attr,
+	&dev_attr_sigio.attr,
+	&dev_attr_used_len.attr,
+	NULL,
+};
+
+static const struct attribute_group awcloud_async_stats_group = {
+	.name  = "stats",
+	.attrs = awcloud_async_stats_attrs,
+};
+
+static const struct attribute_group *awcloud_async_groups[] = {
+	&awcloud_async_stats_group,
+	NULL,
+};
+
+static void awcloud_async_release_device(struct device *device)
+{
+	struct awcloud_async *dev =
+		container_of(device, struct awcloud_async, device);
+
+	free_percpu(dev->stats);
+	kfree(dev);
+}
+
+/*
+ * Create the instance with the given minor, or with the first free one
+ * when index is negative. Returns the minor or a negative error.
+ */
+static int awcloud_async_create(int index)
+{
+	struct awcloud_async *dev;
+	int start = 0 > index ? 0 : index;
+	int end = 0 > index ? MAX_DEVICES : index + 1;
+	int result = 0;
+
+	if (index >= MAX_DEVICES) {
+		return -EINVAL;
 	}
 
-	memset(dev->buffer, 0, BUFFER_LEN);
-	dev->used_len = 0;
+	dev = kzalloc(sizeof(struct awcloud_async), GFP_KERNEL);
+	if (!dev) {
+		return -ENOMEM;
+	}
+	dev->stats = alloc_percpu(struct awcloud_async_stats);
+	if (!dev->stats) {
+		kfree(dev);
+		return -ENOMEM;
+	}
 
 	sema_init(&(dev->sem), 1);
 	init_waitqueue_head(&dev->r_wait);
 	init_waitqueue_head(&dev->w_wait);
-	return result;
 
-device_create_err:
-	cdev_del(&dev->cdev);
-cdev_add_err:
+	mutex_lock(&awcloud_async_lock);
+	result = idr_alloc(&awcloud_async_idr, dev, start, end, GFP_KERNEL);
+	if (0 > result) {
+		mutex_unlock(&awcloud_async_lock);
+		free_percpu(dev->stats);
+		kfree(dev);
+		return (-ENOSPC == result && 0 <= index) ? -EEXIST : result;
+	}
+	index = result;
+
+	device_initialize(&dev->device);
+	dev->device.class = awcloud_async_class;
+	dev->device.devt = MKDEV(major, index);
+	dev->device.release = awcloud_async_release_device;
+	dev->device.groups = awcloud_async_groups;
+	dev_set_drvdata(&dev->device, dev);
+	result = dev_set_name(&dev->device, DEV_NAME"%d", index);
+	if (result) {
+		goto device_add_err;
+	}
+
+	cdev_init(&dev->cdev, &awcloud_async_fops);
+	dev->cdev.owner = THIS_MODULE;
+	result = cdev_device_add(&dev->cdev, &dev->device);
+	if (result) {
+		pr_err("Failed to add char dev into system\n");
+		goto device_add_err;
+	}
+
+	mutex_unlock(&awcloud_async_lock);
+	return index;
+
+device_add_err:
+	idr_remove(&awcloud_async_idr, index);
+	mutex_unlock(&awcloud_async_lock);
+	put_device(&dev->device);
 	return result;
 }
 
-static void release_awcloud_async_chrdev(struct awcloud_async *dev, int index)
+/*
+ * Unhook an instance that is already out of the idr. Files still open on
+ * it are woken up and fail from now on; the memory goes with the last
+ * of them.
+ */
+static void awcloud_async_kill(struct awcloud_async *dev)
+{
+	WRITE_ONCE(dev->dead, true);
+	wake_up_interruptible_all(&dev->r_wait);
+	wake_up_interruptible_all(&dev->w_wait);
+	cdev_device_del(&dev->cdev, &dev->device);
+	put_device(&dev->device);
+}
+
+static int awcloud_async_destroy(int index)
+{
+	struct awcloud_async *dev;
+
+	mutex_lock(&awcloud_async_lock);
+	dev = idr_remove(&awcloud_async_idr, index);
+	mutex_unlock(&awcloud_async_lock);
+	if (!dev) {
+		return -ENODEV;
+	}
+
+	awcloud_async_kill(dev);
+	return 0;
+}
+
+/*
+ * echo <minor> > /sys/class/awcloud/new_device creates an instance, -1
+ * picks the first free minor; echo <minor> > .../delete_device removes
+ * one again.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0)
+static ssize_t new_device_store(struct class *class,
+#else
+static ssize_t new_device_store(const struct class *class,
+#endif
+	struct class_attribute *attr, const char *buf, size_t count)
+{
+	int index;
+	int result;
+
+	result = kstrtoint(buf, 0, &index);
+	if (result) {
+		return result;
+	}
+
+	result = awcloud_async_create(index);
+	return 0 > result ? result : count;
+}
+static CLASS_ATTR_WO(new_device);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0)
+static ssize_t delete_device_store(struct class *class,
+#else
+static ssize_t delete_device_store(const struct class *class,
+#endif
+	struct class_attribute *attr, const char *buf, size_t count)
+{
+	int index;
+	int result;
+
+	result = kstrtoint(buf, 0, &index);
+	if (result) {
+		return result;
+	}
+	if (0 > index) {
+		return -EINVAL;
+	}
+
+	result = awcloud_async_destroy(index);
+	return result ? result : count;
+}
+static CLASS_ATTR_WO(delete_device);
+
+static void awcloud_async_destroy_all(void)
 {
-	dev_t dev_id = MKDEV(major, index);
+	struct awcloud_async *dev;
+	int index;
 
-	device_destroy(dev->class, dev_id);
-	cdev_del(&dev->cdev);
+	idr_for_each_entry(&awcloud_async_idr, dev, index) {
+		idr_remove(&awcloud_async_idr, index);
+		awcloud_async_kill(dev);
+	}
 }
 
 static int __init awcloud_async_init(void)
 {
 	int result = 0;
-	int index = 0;
-	int tmp[3] = {0};
+	unsigned int index = 0;
 	dev_t dev_id;
-	struct class *class = NULL;
 
-	if (0 >= num_devices) {
-		num_devices = 1;
-	}
-
-	dev = kzalloc(sizeof(struct awcloud_async) * num_devices, GFP_KERNEL);
-	if (!dev) {
-		result = -ENOMEM;
-		goto finally;
+	if (num_devices > MAX_DEVICES) {
+		return -EINVAL;
 	}
 
 	if (major > 0) {
 		dev_id = MKDEV(major, 0);
-		result = register_chrdev_region(
-			dev_id, num_devices, DEV_NAME);
+		result = register_chrdev_region(dev_id, MAX_DEVICES, DEV_NAME);
 	} else {
-		result = alloc_chrdev_region(
-			&dev_id, 0, num_devices, DEV_NAME);
+		result = alloc_chrdev_region(&dev_id, 0, MAX_DEVICES, DEV_NAME);
 	}
 
 	if (result) {
 		pr_err("Failed to alloc the char dev number\n");
-		result = -EFAULT;
 		goto alloc_dev_id_err;
 	}
 
 	major = MAJOR(dev_id);
-	class = class_create(THIS_MODULE, DEV_NAME);
-	if (IS_ERR(class)) {
-		result = -1;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0)
+	awcloud_async_class = class_create(THIS_MODULE, DEV_NAME);
+#else
+	awcloud_async_class = class_create(DEV_NAME);
+#endif
+	if (IS_ERR(awcloud_async_class)) {
+		result = PTR_ERR(awcloud_async_class);
 		goto class_create_err;
 	}
 
-	for (index = 0; index < num_devices; index++) {
-		(dev+index)->class = class;
-		tmp[index] = awcloud_async_setup_chrdev(dev+index, index);
-		result |= tmp[index];
+	result = class_create_file(awcloud_async_class, &class_attr_new_device);
+	if (result) {
+		goto new_device_err;
 	}
-
+	result = class_create_file(awcloud_async_class,
+		&class_attr_delete_device);
 	if (result) {
-		for (index = 0; index < num_devices; index++) {
-			if (!tmp[index]) {
-				release_awcloud_async_chrdev(dev+index, index);
-			}
+		goto delete_device_err;
+	}
+
+	for (index = 0; index < num_devices; index++) {
+		result = awcloud_async_create(index);
+		if (0 > result) {
+			goto create_err;
 		}
-		goto setup_chrdev_err;
 	}
 
-	return result;
+	return 0;
 
-setup_chrdev_err:
-	class_destroy(class);
+create_err:
+	awcloud_async_destroy_all();
+	class_remove_file(awcloud_async_class, &class_attr_delete_device);
+delete_device_err:
+	class_remove_file(awcloud_async_class, &class_attr_new_device);
+new_device_err:
+	class_destroy(awcloud_async_class);
 class_create_err:
-	unregister_chrdev_region(MKDEV(major, 0), num_devices);
+	unregister_chrdev_region(MKDEV(major, 0), MAX_DEVICES);
 alloc_dev_id_err:
-	kfree(dev);
-finally:
 	return result;
 }
 
 static void __exit awcloud_async_exit(void)
 {
-	int index = 0;
-
-	for (index = 0; index < num_devices; index++) {
-		release_awcloud_async_chrdev(dev+index, index);
-	}
-
-	class_destroy(dev->class);
-	unregister_chrdev_region(MKDEV(major, 0), num_devices);
-	kfree(dev);
+	/* No new instance can show up once the attributes are gone */
+	class_remove_file(awcloud_async_class, &class_attr_delete_device);
+	class_remove_file(awcloud_async_class, &class_attr_new_device);
+	awcloud_async_destroy_all();
+	idr_destroy(&awcloud_async_idr);
+	class_destroy(awcloud_async_class);
+	unregister_chrdev_region(MKDEV(major, 0), MAX_DEVICES);
 }
 
 module_init(awcloud_async_init);
@@ -6,11 +6,24 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
 #include <linux/device.h>
 #endif
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+/*
+ * Debug messages, off unless enabled through dynamic debug and rate
+ * limited when on. Each one starts with its category (io, seek, ioctl)
+ * so a category can be switched on by itself, e.g.
+ *   echo 'module awcloud format "io: " +p' > /proc/dynamic_debug/control
+ */
+#define awcloud_dbg(cat, fmt, ...) \
+	pr_debug_ratelimited(cat ": " fmt, ##__VA_ARGS__)
+
 #define DEV_NAME "awcloud"
 #define BUFFER_LEN 4096
 #define MEM_CLEAR 0x1
@@ -33,6 +46,9 @@ module_param(major, uint, 0444);
 
 static int open_awcloud_mem(struct inode *inodep, struct file *filp)
 {
+#ifdef FMODE_NOWAIT
+	filp->f_mode |= FMODE_NOWAIT;
+#endif
 	if (!atomic_dec_and_test(&awcloud_available)) {
 		atomic_inc(&awcloud_available);
 		return -EBUSY;
@@ -47,83 +63,101 @@ static int release_awcloud_mem(struct inode *inodep, struct file *filp)
 	return 0;
 }
 
-static ssize_t read_awcloud_mem(struct file *filp,
-	char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t awcloud_mem_read(struct kiocb *iocb, struct iov_iter *to)
 {
-	int ret = 0;
-	struct awcloud_mem *dev = (struct awcloud_mem *)filp->private_data;
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(to);
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_mem *dev =
+		(struct awcloud_mem *)iocb->ki_filp->private_data;
 
-	if (*ppos >= BUFFER_LEN) {
+	if (pos >= BUFFER_LEN) {
 		return count ? -ENXIO:0;
 	}
 
-	if (count > (BUFFER_LEN - *ppos)) {
-		count = BUFFER_LEN - *ppos;
+	if (count > (BUFFER_LEN - pos)) {
+		count = BUFFER_LEN - pos;
 	}
 
-	if (copy_to_user(user_buffer, (void *)(dev->buffer + *ppos), count)) {
-		return -EFAULT;
+	ret = copy_to_iter(dev->buffer + pos, count, to);
+	if (!ret && count) {
+		ret = -EFAULT;
+	} else {
+		iocb->ki_pos = pos + ret;
 	}
 
-	*ppos += count;
-	ret = count;
-
 	return ret;
 }
 
-static ssize_t write_awcloud_mem(struct file *filp,
-	const char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t read_iter_awcloud_mem(struct kiocb *iocb, struct iov_iter *to)
 {
-	int ret = 0;
+	struct file *filp = iocb->ki_filp;
 	struct awcloud_mem *dev = (struct awcloud_mem *)filp->private_data;
+	unsigned int minor = iminor(file_inode(filp));
+	ssize_t ret;
+
+	trace_awcloud_read_enter(minor, iov_iter_count(to), iocb->ki_pos);
+	ret = awcloud_mem_read(iocb, to);
+	trace_awcloud_read_exit(minor, ret, dev->used_len);
+
+	return ret;
+}
 
-	if (*ppos >= BUFFER_LEN) {
+static ssize_t awcloud_mem_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(from);
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_mem *dev =
+		(struct awcloud_mem *)iocb->ki_filp->private_data;
+
+	if (pos >= BUFFER_LEN) {
 		return count ? -ENXIO:0;
 	}
 
-	if (count > BUFFER_LEN - *ppos) {
-		count = BUFFER_LEN - *ppos;
+	if (count > BUFFER_LEN - pos) {
+		count = BUFFER_LEN - pos;
 	}
 
-	pr_info(
-#if defined(__arm__)
-		"Calling the write function with count %d, and ppos %lld\n",
-#else
-		"Calling the write function with count %ld, and ppos %lld\n",
-#endif
-		count, *ppos);
+	awcloud_dbg("io", "write %zu bytes at %lld\n", count, pos);
 
-	if (copy_from_user(dev->buffer + *ppos, user_buffer, count)) {
+	ret = copy_from_iter(dev->buffer + pos, count, from);
+	if (!ret && count) {
 		ret = -EFAULT;
-		return ret;
-	}
-
-	*ppos += count;
-	if (*ppos > dev->used_len) {
-		dev->used_len = *ppos;
+	} else {
+		iocb->ki_pos = pos + ret;
+		if (iocb->ki_pos > dev->used_len) {
+			dev->used_len = iocb->ki_pos;
+		}
 	}
-	ret = count;
 
 	return ret;
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
-int ioctl_awcloud_mem(struct inode *inodep,
-	struct file *filp, unsigned int cmd, unsigned long arg)
+static ssize_t write_iter_awcloud_mem(struct kiocb *iocb, struct iov_iter *from)
 {
-#else
-static long ioctl_awcloud_mem(struct file *filp,
-	unsigned int cmd, unsigned long arg)
+	struct file *filp = iocb->ki_filp;
+	struct awcloud_mem *dev = (struct awcloud_mem *)filp->private_data;
+	unsigned int minor = iminor(file_inode(filp));
+	ssize_t ret;
+
+	trace_awcloud_write_enter(minor, iov_iter_count(from), iocb->ki_pos);
+	ret = awcloud_mem_write(iocb, from);
+	trace_awcloud_write_exit(minor, ret, dev->used_len);
+
+	return ret;
+}
+
+static long awcloud_mem_ioctl(struct file *filp, unsigned int cmd,
+	unsigned long arg)
 {
-	//struct inode *inodep = file_inode(filp);
-#endif
 	struct awcloud_mem *dev = (struct awcloud_mem *)filp->private_data;
 
 	switch (cmd) {
 	case MEM_CLEAR:
 		memset(dev->buffer, 0, BUFFER_LEN);
 		dev->used_len = 0;
-		pr_info("Set Kernel Buffer to Zero\n");
+		awcloud_dbg("ioctl", "buffer cleared\n");
 		break;
 	default:
 		return -EINVAL;
@@ -131,15 +165,26 @@ static long ioctl_awcloud_mem(struct file *filp,
 	return 0;
 }
 
+static long ioctl_awcloud_mem(struct file *filp,
+	unsigned int cmd, unsigned long arg)
+{
+	unsigned int minor = iminor(file_inode(filp));
+	long ret;
+
+	trace_awcloud_ioctl_enter(minor, cmd, arg);
+	ret = awcloud_mem_ioctl(filp, cmd, arg);
+	trace_awcloud_ioctl_exit(minor, cmd, ret);
+
+	return ret;
+}
+
 static loff_t llseek_awcloud_mem(struct file *filp,
 	loff_t offset, int whence)
 {
 	loff_t ret = 0;
 	struct awcloud_mem *dev = (struct awcloud_mem *)filp->private_data;
 
-	pr_info(
-		"Calling the llseek function of this device,"
-		"and offset is %lld , whence is %d\n", offset, whence);
+	awcloud_dbg("seek", "offset %lld whence %d\n", offset, whence);
 	switch (whence) {
 	case SEEK_SET:
 		if (offset < 0) {
@@ -190,18 +235,14 @@ static loff_t llseek_awcloud_mem(struct file *filp,
 }
 
 static const struct file_operations awcloud_mem_fops = {
-	.owner   = THIS_MODULE,
-	.open    = open_awcloud_mem,
-	.release = release_awcloud_mem,
-	.read    = read_awcloud_mem,
-	.write   = write_awcloud_mem,
-	.llseek  = llseek_awcloud_mem,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 0)
-	.ioctl   = ioctl_awcloud_mem,
-#else
-	.compat_ioctl = ioctl_awcloud_mem,
+	.owner          = THIS_MODULE,
+	.open           = open_awcloud_mem,
+	.release        = release_awcloud_mem,
+	.read_iter      = read_iter_awcloud_mem,
+	.write_iter     = write_iter_awcloud_mem,
+	.llseek         = llseek_awcloud_mem,
+	.compat_ioctl   = ioctl_awcloud_mem,
 	.unlocked_ioctl = ioctl_awcloud_mem,
-#endif
 };
 
 static int awcloud_mem_setup_chrdev(struct awcloud_mem *dev)
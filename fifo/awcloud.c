@@ -6,7 +6,13 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/poll.h>
+#include <linux/hrtimer.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
 #include <linux/device.h>
@@ -14,177 +20,883 @@
 #include <linux/sched/signal.h>
 #endif
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+/*
+ * Debug messages, off unless enabled through dynamic debug and rate
+ * limited when on. Each one starts with its category (io, seek, ioctl)
+ * so a category can be switched on by itself, e.g.
+ *   echo 'module awcloud format "io: " +p' > /proc/dynamic_debug/control
+ */
+#define awcloud_dbg(cat, fmt, ...) \
+	pr_debug_ratelimited(cat ": " fmt, ##__VA_ARGS__)
+
 #define DEV_NAME "awcloud"
 #define BUFFER_LEN 4096
+#define BUFFER_MASK (BUFFER_LEN - 1)
 #define MEM_CLEAR 0x1
+#define FIFO_SET_LOW_WATERMARK 0x2
+#define FIFO_SET_HIGH_WATERMARK 0x3
+#define FIFO_SET_MAX_DELAY 0x4
+#define FIFO_SET_MODE 0x5
+#define FIFO_RING_NOTIFY 0x6
+
+#define FIFO_MODE_STREAM 0
+#define FIFO_MODE_RECORD 1
+
+/*
+ * The part of the fifo that is shared with userspace through mmap, one
+ * page each: head at offset 0, tail at PAGE_SIZE, the read-only control
+ * fields at 2 * PAGE_SIZE, and the data area right after them. head is
+ * only written by the producer and tail only by the consumer, and having
+ * them on separate pages lets each side be given write access to its own
+ * index alone. The kernel sets reader_waiting/writer_waiting before it
+ * sleeps; a process that moves head or tail through the mapping checks
+ * them after publishing and issues FIFO_RING_NOTIFY if the other side is
+ * waiting.
+ */
+struct awcloud_fifo_ring {
+	u32 head __aligned(PAGE_SIZE);
+	u32 tail __aligned(PAGE_SIZE);
+	u32 size __aligned(PAGE_SIZE);
+	u32 mode;
+	u32 reader_waiting;
+	u32 writer_waiting;
+};
+
+#define FIFO_RING_HEAD_PGOFF 0
+#define FIFO_RING_TAIL_PGOFF 1
+#define FIFO_RING_CTRL_PGOFF 2
+#define FIFO_RING_DATA_PGOFF (sizeof(struct awcloud_fifo_ring) >> PAGE_SHIFT)
 
+/*
+ * head and tail are free running byte counters: the writer appends at
+ * head, the reader consumes from tail, and head - tail is the number of
+ * queued bytes. BUFFER_LEN must be a power of two so that the counters
+ * can wrap and be masked into the buffer.
+ *
+ * In record mode every message is stored as a u32 length followed by the
+ * payload, so message boundaries survive the trip through the ring.
+ */
 struct awcloud_fifo {
 	dev_t             dev_id;
 	unsigned int      major;
 	unsigned int      minor;
-	unsigned int      used_len;
+	unsigned int      mode;
 	struct device     *device;
 	struct class      *class;
 	struct cdev       *cdev;
-	char              buffer[BUFFER_LEN];
+	struct awcloud_fifo_ring *ring;
+	char              *data;
 	struct semaphore  sem;
+	struct mutex      r_lock;
+	struct mutex      w_lock;
 	wait_queue_head_t r_wait;
 	wait_queue_head_t w_wait;
+	struct file       *reader;
+	struct file       *writer;
+	unsigned int      low_watermark;
+	unsigned int      high_watermark;
+	unsigned int      max_delay_us;
+	bool              flush;
+	struct hrtimer    delay_timer;
 };
 
 static struct awcloud_fifo *dev;
 static unsigned int major;
+static bool spsc;
 module_param(major, uint, 0444);
+module_param(spsc, bool, 0444);
+MODULE_PARM_DESC(spsc, "Lockless mode for one reader and one writer");
+
+static inline unsigned int awcloud_fifo_used(struct awcloud_fifo *dev)
+{
+	return READ_ONCE(dev->ring->head) - READ_ONCE(dev->ring->tail);
+}
+
+/*
+ * The SPSC form: once the ring is mapped either index may also be moved
+ * from userspace, so a sleeper re-reads both of them every time it
+ * evaluates its wait condition.
+ */
+static inline unsigned int awcloud_fifo_used_acquire(struct awcloud_fifo *dev)
+{
+	return smp_load_acquire(&dev->ring->head) -
+		smp_load_acquire(&dev->ring->tail);
+}
+
+/*
+ * Once the ring is mapped, head and tail may be written by userspace, so
+ * they are validated before any copy is sized from them.
+ */
+static inline bool awcloud_fifo_sane(unsigned int head, unsigned int tail)
+{
+	return head - tail <= BUFFER_LEN;
+}
+
+static size_t awcloud_fifo_copy_to_iter(struct awcloud_fifo *dev,
+	unsigned int tail, size_t count, struct iov_iter *to)
+{
+	unsigned int offset = tail & BUFFER_MASK;
+	size_t first = min_t(size_t, count, BUFFER_LEN - offset);
+	size_t copied;
+
+	copied = copy_to_iter(dev->data + offset, first, to);
+	if (copied == first && count > first) {
+		copied += copy_to_iter(dev->data, count - first, to);
+	}
+
+	return copied;
+}
+
+static size_t awcloud_fifo_copy_from_iter(struct awcloud_fifo *dev,
+	unsigned int head, size_t count, struct iov_iter *from)
+{
+	unsigned int offset = head & BUFFER_MASK;
+	size_t first = min_t(size_t, count, BUFFER_LEN - offset);
+	size_t copied;
+
+	copied = copy_from_iter(dev->data + offset, first, from);
+	if (copied == first && count > first) {
+		copied += copy_from_iter(dev->data, count - first, from);
+	}
+
+	return copied;
+}
+
+static void awcloud_fifo_peek(struct awcloud_fifo *dev,
+	unsigned int tail, void *data, size_t len)
+{
+	unsigned int offset = tail & BUFFER_MASK;
+	size_t first = min_t(size_t, len, BUFFER_LEN - offset);
+
+	memcpy(data, dev->data + offset, first);
+	memcpy((char *)data + first, dev->data, len - first);
+}
+
+static void awcloud_fifo_poke(struct awcloud_fifo *dev,
+	unsigned int head, const void *data, size_t len)
+{
+	unsigned int offset = head & BUFFER_MASK;
+	size_t first = min_t(size_t, len, BUFFER_LEN - offset);
+
+	memcpy(dev->data + offset, data, first);
+	memcpy(dev->data, (const char *)data + first, len - first);
+}
+
+/*
+ * Record mode keeps message boundaries. write() queues one record and
+ * writev() queues one record per iovec segment. A read() returns exactly
+ * one whole record, so the return value is the length of that record.
+ *
+ * A readv() with more than one segment dequeues as many whole records as
+ * fit in the iovec, each still preceded by its u32 length as it sits in
+ * the ring, so the caller can split them up again. The iovec is treated
+ * as one buffer: a record may straddle two segments.
+ *
+ * Either way, a record larger than the space left stays queued. If not
+ * even the first one fits, the read fails with -EMSGSIZE.
+ */
+static ssize_t awcloud_fifo_read_records(struct awcloud_fifo *dev,
+	unsigned int head, unsigned int *tail, struct iov_iter *to)
+{
+	bool batch = iter_is_iovec(to) && to->nr_segs > 1;
+	ssize_t copied = 0;
+	size_t size;
+	u32 len;
+
+	while (head - *tail >= sizeof(len)) {
+		awcloud_fifo_peek(dev, *tail, &len, sizeof(len));
+		if (len > head - *tail - sizeof(len)) {
+			return copied ? copied : -EIO;
+		}
+
+		if (!batch) {
+			if (len > iov_iter_count(to)) {
+				return -EMSGSIZE;
+			}
+			if (awcloud_fifo_copy_to_iter(dev, *tail + sizeof(len),
+				len, to) != len) {
+				return -EFAULT;
+			}
+			*tail += sizeof(len) + len;
+			return len;
+		}
+
+		size = sizeof(len) + len;
+		if (size > iov_iter_count(to)) {
+			return copied ? copied : -EMSGSIZE;
+		}
+		if (awcloud_fifo_copy_to_iter(dev, *tail, size, to) != size) {
+			return copied ? copied : -EFAULT;
+		}
+		*tail += size;
+		copied += size;
+	}
+
+	return copied;
+}
+
+static ssize_t awcloud_fifo_write_records(struct awcloud_fifo *dev,
+	unsigned int *head, unsigned int tail, struct iov_iter *from)
+{
+	ssize_t copied = 0;
+	size_t seg;
+	u32 len;
+
+	while (iov_iter_count(from)) {
+		seg = iov_iter_single_seg_count(from);
+		if (!seg) {
+			/*
+			 * An empty segment is not a record: copying zero bytes
+			 * would not move past it, so step over it explicitly.
+			 */
+			iov_iter_advance(from, 0);
+			continue;
+		}
+		/* Checked before it is narrowed to the u32 record header */
+		if (seg > BUFFER_LEN - sizeof(len)) {
+			return copied ? copied : -EMSGSIZE;
+		}
+		len = seg;
+		if (sizeof(len) + len > BUFFER_LEN - (*head - tail)) {
+			break;
+		}
+
+		if (awcloud_fifo_copy_from_iter(dev, *head + sizeof(len),
+			len, from) != len) {
+			return copied ? copied : -EFAULT;
+		}
+		awcloud_fifo_poke(dev, *head, &len, sizeof(len));
+
+		*head += sizeof(len) + len;
+		copied += len;
+	}
+
+	return copied;
+}
+
+/*
+ * Move data between the ring and the iterator. The caller owns the side
+ * being advanced (under dev->sem, or as the single SPSC reader/writer)
+ * and publishes the updated index itself.
+ */
+static ssize_t awcloud_fifo_dequeue(struct awcloud_fifo *dev,
+	unsigned int head, unsigned int *tail, struct iov_iter *to)
+{
+	size_t count = iov_iter_count(to);
+
+	if (!awcloud_fifo_sane(head, *tail)) {
+		return -EIO;
+	}
+
+	if (FIFO_MODE_RECORD == READ_ONCE(dev->mode)) {
+		return awcloud_fifo_read_records(dev, head, tail, to);
+	}
+
+	if (count > head - *tail) {
+		count = head - *tail;
+	}
+	if (!count) {
+		return 0;
+	}
+
+	count = awcloud_fifo_copy_to_iter(dev, *tail, count, to);
+	if (!count) {
+		return -EFAULT;
+	}
+	*tail += count;
+
+	return count;
+}
+
+static ssize_t awcloud_fifo_enqueue(struct awcloud_fifo *dev,
+	unsigned int *head, unsigned int tail, struct iov_iter *from)
+{
+	size_t count = iov_iter_count(from);
+
+	if (!awcloud_fifo_sane(*head, tail)) {
+		return -EIO;
+	}
+
+	if (FIFO_MODE_RECORD == READ_ONCE(dev->mode)) {
+		return awcloud_fifo_write_records(dev, head, tail, from);
+	}
+
+	if (count > BUFFER_LEN - (*head - tail)) {
+		count = BUFFER_LEN - (*head - tail);
+	}
+	if (!count) {
+		return 0;
+	}
+
+	count = awcloud_fifo_copy_from_iter(dev, *head, count, from);
+	if (!count) {
+		return -EFAULT;
+	}
+	*head += count;
+
+	return count;
+}
+
+/* Free space a writer has to wait for before it can make progress */
+static inline size_t awcloud_fifo_room_needed(struct awcloud_fifo *dev,
+	struct iov_iter *from)
+{
+	if (FIFO_MODE_RECORD == READ_ONCE(dev->mode)) {
+		return sizeof(u32) + iov_iter_single_seg_count(from);
+	}
+	return 1;
+}
+
+/*
+ * Wakeup coalescing. Sleeping readers are only woken once high_watermark
+ * bytes are queued, or once max_delay_us has passed since data arrived in
+ * an empty ring (flush). Sleeping writers are only woken once the ring
+ * has drained down to low_watermark. The defaults wake on every byte.
+ */
+static inline bool awcloud_fifo_readable(struct awcloud_fifo *dev,
+	unsigned int used)
+{
+	return used >= READ_ONCE(dev->high_watermark) ||
+		(used && READ_ONCE(dev->flush));
+}
+
+static inline bool awcloud_fifo_writable(struct awcloud_fifo *dev,
+	unsigned int used)
+{
+	return used <= READ_ONCE(dev->low_watermark);
+}
+
+static inline bool awcloud_fifo_has_room(struct awcloud_fifo *dev,
+	unsigned int used, size_t needed)
+{
+	return awcloud_fifo_writable(dev, used) && BUFFER_LEN - used >= needed;
+}
+
+/*
+ * Wait conditions of the SPSC sleepers. The waiting flag is raised again
+ * on every pass, right before the ring is sampled, so it is up whenever
+ * the sleeper goes back to sleep and a process publishing through the
+ * mapping always knows to issue FIFO_RING_NOTIFY. Only the sleeper
+ * lowers it, once its wait is over.
+ */
+static inline bool awcloud_fifo_reader_ready(struct awcloud_fifo *dev)
+{
+	WRITE_ONCE(dev->ring->reader_waiting, 1);
+	smp_mb();
+	return awcloud_fifo_readable(dev, awcloud_fifo_used_acquire(dev));
+}
+
+static inline bool awcloud_fifo_writer_ready(struct awcloud_fifo *dev,
+	size_t needed)
+{
+	WRITE_ONCE(dev->ring->writer_waiting, 1);
+	smp_mb();
+	return awcloud_fifo_has_room(dev, awcloud_fifo_used_acquire(dev),
+		needed);
+}
+
+static void awcloud_fifo_wake_readers(struct awcloud_fifo *dev,
+	unsigned int used, int source)
+{
+	unsigned int max_delay_us = READ_ONCE(dev->max_delay_us);
+
+	if (awcloud_fifo_readable(dev, used)) {
+		hrtimer_try_to_cancel(&dev->delay_timer);
+		if (wq_has_sleeper(&dev->r_wait)) {
+			trace_awcloud_wakeup(dev->minor, source,
+				POLLIN | POLLRDNORM);
+			wake_up_interruptible_poll(&dev->r_wait,
+				POLLIN | POLLRDNORM);
+		}
+	} else if (used && max_delay_us &&
+		!hrtimer_is_queued(&dev->delay_timer)) {
+		hrtimer_start(&dev->delay_timer,
+			ns_to_ktime((u64)max_delay_us * NSEC_PER_USEC),
+			HRTIMER_MODE_REL);
+	}
+}
+
+static void awcloud_fifo_wake_writers(struct awcloud_fifo *dev,
+	unsigned int used, int source)
+{
+	if (awcloud_fifo_writable(dev, used) && wq_has_sleeper(&dev->w_wait)) {
+		trace_awcloud_wakeup(dev->minor, source, POLLOUT | POLLWRNORM);
+		wake_up_interruptible_poll(&dev->w_wait, POLLOUT | POLLWRNORM);
+	}
+}
+
+static enum hrtimer_restart awcloud_fifo_delay_handler(struct hrtimer *timer)
+{
+	struct awcloud_fifo *dev =
+		container_of(timer, struct awcloud_fifo, delay_timer);
+
+	WRITE_ONCE(dev->flush, true);
+	trace_awcloud_wakeup(dev->minor, AWCLOUD_WAKE_TIMER,
+		POLLIN | POLLRDNORM);
+	wake_up_interruptible_poll(&dev->r_wait, POLLIN | POLLRDNORM);
+
+	return HRTIMER_NORESTART;
+}
+
+static int awcloud_fifo_set_tunable(struct awcloud_fifo *dev,
+	unsigned int cmd, unsigned long value)
+{
+	switch (cmd) {
+	case FIFO_SET_LOW_WATERMARK:
+		if (value >= BUFFER_LEN) {
+			return -EINVAL;
+		}
+		WRITE_ONCE(dev->low_watermark, value);
+		break;
+	case FIFO_SET_HIGH_WATERMARK:
+		if (!value || value > BUFFER_LEN) {
+			return -EINVAL;
+		}
+		WRITE_ONCE(dev->high_watermark, value);
+		break;
+	case FIFO_SET_MAX_DELAY:
+		if (value != (unsigned int)value) {
+			return -EINVAL;
+		}
+		WRITE_ONCE(dev->max_delay_us, value);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	/* Let every sleeper re-evaluate against the new thresholds */
+	trace_awcloud_wakeup(dev->minor, AWCLOUD_WAKE_IOCTL, 0);
+	wake_up_interruptible_all(&dev->r_wait);
+	wake_up_interruptible_all(&dev->w_wait);
+
+	return 0;
+}
+
+/*
+ * In SPSC mode the ring is only safe with one consumer and one producer,
+ * so each side belongs to a single open file and everybody else gets
+ * -EBUSY. A file opened for one direction takes its side at open. A file
+ * opened O_RDWR takes a side the first time it acts as it: by read() or
+ * write(), or by mapping that side's index writable. The VFS only hands
+ * out shared writable mappings of files opened for writing, so this lets
+ * a consumer open O_RDWR to move tail through the mapping while the
+ * producer side stays free.
+ */
+static int awcloud_fifo_claim(struct file **side, struct file *filp)
+{
+	struct file *owner = READ_ONCE(*side);
+
+	if (owner == filp) {
+		return 0;
+	}
+	if (!owner && !cmpxchg(side, NULL, filp)) {
+		return 0;
+	}
+	return -EBUSY;
+}
 
 static int open_awcloud_fifo(struct inode *inodep, struct file *filp)
 {
+	if (spsc && !(filp->f_mode & FMODE_WRITE) &&
+		awcloud_fifo_claim(&dev->reader, filp)) {
+		return -EBUSY;
+	}
+	if (spsc && !(filp->f_mode & FMODE_READ) &&
+		awcloud_fifo_claim(&dev->writer, filp)) {
+		return -EBUSY;
+	}
+
 	filp->private_data = dev;
+#ifdef FMODE_NOWAIT
+	filp->f_mode |= FMODE_NOWAIT;
+#endif
 	return 0;
 }
 
 static int release_awcloud_fifo(struct inode *inodep, struct file *filp)
 {
+	struct awcloud_fifo *dev = (struct awcloud_fifo *)filp->private_data;
+
+	if (spsc) {
+		cmpxchg(&dev->reader, filp, NULL);
+		cmpxchg(&dev->writer, filp, NULL);
+	}
 	return 0;
 }
 
-static ssize_t read_awcloud_fifo(struct file *filp,
-	char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t awcloud_fifo_read(struct kiocb *iocb, struct iov_iter *to)
 {
-	int ret = 0;
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(to);
+	struct file *filp = iocb->ki_filp;
 	struct awcloud_fifo *dev = (struct awcloud_fifo *)filp->private_data;
+	u64 since;
+	int result;
 
-	DECLARE_WAITQUEUE(wait, current);
-
-	down(&dev->sem);
-	add_wait_queue(&dev->r_wait, &wait);
-
-	if (0 == dev->used_len) {
-		if (filp->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			goto again_err;
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (down_trylock(&dev->sem)) {
+			return -EAGAIN;
 		}
-		__set_current_state(TASK_INTERRUPTIBLE);
+	} else {
+		down(&dev->sem);
+	}
+	while (0 == awcloud_fifo_used(dev)) {
 		up(&dev->sem);
-		schedule();
-
-		if (signal_pending(current)) {
-			ret = -ERESTARTSYS;
-			goto out;
+		if ((filp->f_flags & O_NONBLOCK) ||
+			(iocb->ki_flags & IOCB_NOWAIT)) {
+			return -EAGAIN;
+		}
+		/*
+		 * Exclusive wait: one writer wakes one reader instead of the
+		 * whole queue, and the condition is rechecked under the lock.
+		 */
+		since = trace_awcloud_wait_enabled() ? ktime_get_ns() : 0;
+		result = wait_event_interruptible_exclusive(dev->r_wait,
+			awcloud_fifo_readable(dev, awcloud_fifo_used(dev)));
+		trace_awcloud_wait(dev->minor, false, since, result);
+		if (result) {
+			return -ERESTARTSYS;
 		}
 		down(&dev->sem);
 	}
 
-	if (count > dev->used_len) {
-		count = dev->used_len;
-	}
-
-	if (copy_to_user(user_buffer, dev->buffer, count)) {
-		ret = -EFAULT;
+	ret = awcloud_fifo_dequeue(dev, dev->ring->head, &dev->ring->tail, to);
+	if (0 > ret) {
 		goto copy_to_user_err;
 	}
+	count = ret;
 
-	//memcpy(dev->buffer, dev->buffer+count, dev->used_len-count);
-	dev->used_len -= count;
-#if defined(__arm__)
-	pr_info("Read %d bytes, current lenth is %d\n", count, dev->used_len);
-#else
-	pr_info("Read %ld bytes, current lenth is %d\n", count, dev->used_len);
-#endif
-	wake_up_interruptible(&dev->w_wait);
-	ret = count;
+	awcloud_dbg("io", "read %zu bytes, %u left\n", count,
+		awcloud_fifo_used(dev));
+	awcloud_fifo_wake_writers(dev, awcloud_fifo_used(dev),
+		AWCLOUD_WAKE_READ);
+	/* Hand the wakeup on to the next reader */
+	awcloud_fifo_wake_readers(dev, awcloud_fifo_used(dev),
+		AWCLOUD_WAKE_READ);
 
-again_err:
 copy_to_user_err:
 	up(&dev->sem);
 
-out:
-	remove_wait_queue(&dev->r_wait, &wait);
-	set_current_state(TASK_RUNNING);
-
 	return ret;
 }
 
-static ssize_t write_awcloud_fifo(struct file *filp,
-	const char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t awcloud_fifo_write(struct kiocb *iocb, struct iov_iter *from)
 {
-	int ret = 0;
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(from);
+	size_t needed;
+	unsigned int used;
+	struct file *filp = iocb->ki_filp;
 	struct awcloud_fifo *dev = (struct awcloud_fifo *)filp->private_data;
-	DECLARE_WAITQUEUE(wait, current);
+	u64 since;
+	int result;
 
-	pr_info(
-#if defined(__arm__)
-		"Calling the write function with count %d, and ppos %lld\n",
-#else
-		"Calling the write function with count %ld, and ppos %lld\n",
-#endif
-		count, *ppos);
+	needed = awcloud_fifo_room_needed(dev, from);
+	if (needed > BUFFER_LEN) {
+		return -EMSGSIZE;
+	}
 
-	down(&dev->sem);
-	add_wait_queue(&dev->w_wait, &wait);
+	awcloud_dbg("io", "write %zu bytes at %lld\n", count, iocb->ki_pos);
 
-	if (BUFFER_LEN == dev->used_len) {
-		if (filp->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			goto again_err;
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (down_trylock(&dev->sem)) {
+			return -EAGAIN;
 		}
-		__set_current_state(TASK_INTERRUPTIBLE);
+	} else {
+		down(&dev->sem);
+	}
+	while (BUFFER_LEN - awcloud_fifo_used(dev) < needed) {
 		up(&dev->sem);
-		schedule();
-		if (signal_pending(current)) {
-			ret = -ERESTARTSYS;
-			goto out;
+		if ((filp->f_flags & O_NONBLOCK) ||
+			(iocb->ki_flags & IOCB_NOWAIT)) {
+			return -EAGAIN;
+		}
+		since = trace_awcloud_wait_enabled() ? ktime_get_ns() : 0;
+		result = wait_event_interruptible_exclusive(dev->w_wait,
+			awcloud_fifo_has_room(dev,
+				awcloud_fifo_used(dev), needed));
+		trace_awcloud_wait(dev->minor, true, since, result);
+		if (result) {
+			return -ERESTARTSYS;
 		}
 		down(&dev->sem);
 	}
 
-	if (count > BUFFER_LEN - dev->used_len) {
-		count = BUFFER_LEN - dev->used_len;
-	}
-
-	if (copy_from_user(dev->buffer+dev->used_len, user_buffer, count)) {
-		ret = -EFAULT;
+	used = awcloud_fifo_used(dev);
+	ret = awcloud_fifo_enqueue(dev, &dev->ring->head, dev->ring->tail,
+		from);
+	if (0 > ret) {
 		goto copy_from_user_err;
 	}
 
-	dev->used_len += count;
-	wake_up_interruptible(&dev->r_wait);
-	ret = count;
+	if (0 == used) {
+		WRITE_ONCE(dev->flush, false);
+	}
+	awcloud_fifo_wake_readers(dev, awcloud_fifo_used(dev),
+		AWCLOUD_WAKE_WRITE);
+	/* Hand the wakeup on to the next writer */
+	awcloud_fifo_wake_writers(dev, awcloud_fifo_used(dev),
+		AWCLOUD_WAKE_WRITE);
 
-again_err:
 copy_from_user_err:
 	up(&dev->sem);
 
-out:
-	remove_wait_queue(&dev->w_wait, &wait);
-	set_current_state(TASK_RUNNING);
+	return ret;
+}
+
+/*
+ * SPSC fast path. Only the reader moves tail and only the writer moves
+ * head, so each side publishes its index with a release store after
+ * touching the data and reads the other side's index with an acquire
+ * load. wq_has_sleeper() pairs with the barrier in wait_event so a
+ * wakeup is never lost.
+ *
+ * Opening is limited to one file per side, but threads or forked
+ * children can still share that file. Each side is therefore serialized
+ * by its own mutex, r_lock or w_lock. With a single user this costs one
+ * uncontended atomic, and the reader and writer still never share a lock.
+ * The side lock only covers moving data: it is dropped before sleeping
+ * on an empty or full ring, so MEM_CLEAR and FIFO_SET_MODE never wait
+ * for the other side to show up.
+ */
+static int awcloud_fifo_lock_side(struct mutex *lock, struct kiocb *iocb)
+{
+	if ((iocb->ki_filp->f_flags & O_NONBLOCK) ||
+		(iocb->ki_flags & IOCB_NOWAIT)) {
+		return mutex_trylock(lock) ? 0 : -EAGAIN;
+	}
+	return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
+
+/* Dequeue what is there, or -EAGAIN on an empty ring. Under r_lock. */
+static ssize_t awcloud_fifo_consume(struct awcloud_fifo *dev,
+	struct iov_iter *to)
+{
+	ssize_t ret;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int new_tail;
+
+	tail = smp_load_acquire(&dev->ring->tail);
+	head = smp_load_acquire(&dev->ring->head);
+	if (head == tail) {
+		return -EAGAIN;
+	}
+
+	new_tail = tail;
+	ret = awcloud_fifo_dequeue(dev, head, &new_tail, to);
+	if (new_tail != tail) {
+		smp_store_release(&dev->ring->tail, new_tail);
+		awcloud_fifo_wake_writers(dev, head - new_tail,
+			AWCLOUD_WAKE_READ);
+	}
 
 	return ret;
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
-int ioctl_awcloud_fifo(struct inode *inodep,
-	struct file *filp, unsigned int cmd, unsigned long arg)
+static ssize_t awcloud_fifo_read_spsc(struct kiocb *iocb, struct iov_iter *to)
 {
-#else
-static long ioctl_awcloud_fifo(struct file *filp,
-	unsigned int cmd, unsigned long arg)
+	struct file *filp = iocb->ki_filp;
+	struct awcloud_fifo *dev = (struct awcloud_fifo *)filp->private_data;
+	ssize_t ret;
+	u64 since;
+
+	ret = awcloud_fifo_claim(&dev->reader, filp);
+	if (ret) {
+		return ret;
+	}
+
+	for (;;) {
+		ret = awcloud_fifo_lock_side(&dev->r_lock, iocb);
+		if (ret) {
+			return ret;
+		}
+		ret = awcloud_fifo_consume(dev, to);
+		mutex_unlock(&dev->r_lock);
+		if (-EAGAIN != ret || (filp->f_flags & O_NONBLOCK) ||
+			(iocb->ki_flags & IOCB_NOWAIT)) {
+			return ret;
+		}
+
+		since = trace_awcloud_wait_enabled() ? ktime_get_ns() : 0;
+		ret = wait_event_interruptible_exclusive(dev->r_wait,
+			awcloud_fifo_reader_ready(dev));
+		WRITE_ONCE(dev->ring->reader_waiting, 0);
+		trace_awcloud_wait(dev->minor, false, since, ret);
+		if (ret) {
+			return -ERESTARTSYS;
+		}
+	}
+}
+
+/* Enqueue what fits, or -EAGAIN without room for needed. Under w_lock. */
+static ssize_t awcloud_fifo_produce(struct awcloud_fifo *dev,
+	struct iov_iter *from, size_t needed)
 {
-	//struct inode *inodep = file_inode(filp);
-#endif
+	ssize_t ret;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int new_head;
+
+	head = smp_load_acquire(&dev->ring->head);
+	tail = smp_load_acquire(&dev->ring->tail);
+	if (BUFFER_LEN - (head - tail) < needed) {
+		return -EAGAIN;
+	}
+
+	new_head = head;
+	ret = awcloud_fifo_enqueue(dev, &new_head, tail, from);
+	if (new_head != head) {
+		if (head == tail) {
+			WRITE_ONCE(dev->flush, false);
+		}
+		smp_store_release(&dev->ring->head, new_head);
+		awcloud_fifo_wake_readers(dev, new_head - tail,
+			AWCLOUD_WAKE_WRITE);
+	}
+
+	return ret;
+}
+
+static ssize_t awcloud_fifo_write_spsc(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	struct file *filp = iocb->ki_filp;
 	struct awcloud_fifo *dev = (struct awcloud_fifo *)filp->private_data;
+	size_t needed;
+	ssize_t ret;
+	u64 since;
+
+	ret = awcloud_fifo_claim(&dev->writer, filp);
+	if (ret) {
+		return ret;
+	}
+
+	for (;;) {
+		needed = awcloud_fifo_room_needed(dev, from);
+		if (needed > BUFFER_LEN) {
+			return -EMSGSIZE;
+		}
+
+		ret = awcloud_fifo_lock_side(&dev->w_lock, iocb);
+		if (ret) {
+			return ret;
+		}
+		ret = awcloud_fifo_produce(dev, from, needed);
+		mutex_unlock(&dev->w_lock);
+		if (-EAGAIN != ret || (filp->f_flags & O_NONBLOCK) ||
+			(iocb->ki_flags & IOCB_NOWAIT)) {
+			return ret;
+		}
+
+		since = trace_awcloud_wait_enabled() ? ktime_get_ns() : 0;
+		ret = wait_event_interruptible_exclusive(dev->w_wait,
+			awcloud_fifo_writer_ready(dev, needed));
+		WRITE_ONCE(dev->ring->writer_waiting, 0);
+		trace_awcloud_wait(dev->minor, true, since, ret);
+		if (ret) {
+			return -ERESTARTSYS;
+		}
+	}
+}
+
+static long awcloud_fifo_ioctl(struct file *filp, unsigned int cmd,
+	unsigned long arg)
+{
+	struct awcloud_fifo *dev = (struct awcloud_fifo *)filp->private_data;
+	unsigned int used;
+	long ret = 0;
 
 	switch (cmd) {
 	case MEM_CLEAR:
+		if (spsc) {
+			/* Dropping queued data moves tail: consumer only */
+			if (!(filp->f_mode & FMODE_READ)) {
+				return -EPERM;
+			}
+			if (awcloud_fifo_claim(&dev->reader, filp)) {
+				return -EBUSY;
+			}
+			if (mutex_lock_interruptible(&dev->r_lock)) {
+				return -ERESTARTSYS;
+			}
+			smp_store_release(&dev->ring->tail,
+				smp_load_acquire(&dev->ring->head));
+			mutex_unlock(&dev->r_lock);
+			trace_awcloud_wakeup(dev->minor, AWCLOUD_WAKE_CLEAR, 0);
+			wake_up_interruptible(&dev->w_wait);
+			break;
+		}
+
 		if (down_interruptible(&dev->sem)) {
 			return -ERESTARTSYS;
 		}
 
-		memset(dev->buffer, 0, BUFFER_LEN);
-		dev->used_len = 0;
+		dev->ring->tail = dev->ring->head;
 
 		up(&dev->sem);
+		trace_awcloud_wakeup(dev->minor, AWCLOUD_WAKE_CLEAR,
+			POLLOUT | POLLWRNORM);
+		wake_up_interruptible_poll(&dev->w_wait, POLLOUT | POLLWRNORM);
 
-		pr_info("Set Kernel Buffer to Zero\n");
+		awcloud_dbg("ioctl", "buffer cleared\n");
+		break;
+	case FIFO_SET_LOW_WATERMARK:
+	case FIFO_SET_HIGH_WATERMARK:
+	case FIFO_SET_MAX_DELAY:
+		return awcloud_fifo_set_tunable(dev, cmd, arg);
+	case FIFO_SET_MODE:
+		if (FIFO_MODE_STREAM != arg && FIFO_MODE_RECORD != arg) {
+			return -EINVAL;
+		}
+
+		/*
+		 * The SPSC paths never take dev->sem. Holding both side locks
+		 * keeps a reader or writer from sampling the old mode and then
+		 * parsing or queueing data after the switch; neither holds its
+		 * lock while sleeping, so this only waits for a copy in flight.
+		 * Userspace moving head or tail through the mapping has to stay
+		 * idle meanwhile.
+		 */
+		if (mutex_lock_interruptible(&dev->r_lock)) {
+			return -ERESTARTSYS;
+		}
+		if (mutex_lock_interruptible(&dev->w_lock)) {
+			mutex_unlock(&dev->r_lock);
+			return -ERESTARTSYS;
+		}
+		if (down_interruptible(&dev->sem)) {
+			ret = -ERESTARTSYS;
+			goto set_mode_err;
+		}
+
+		/* Queued bytes would be misparsed in the other mode */
+		if (smp_load_acquire(&dev->ring->head) !=
+			smp_load_acquire(&dev->ring->tail)) {
+			ret = -EBUSY;
+		} else {
+			WRITE_ONCE(dev->mode, arg);
+			WRITE_ONCE(dev->ring->mode, arg);
+		}
+
+		up(&dev->sem);
+set_mode_err:
+		mutex_unlock(&dev->w_lock);
+		mutex_unlock(&dev->r_lock);
+		return ret;
+	case FIFO_RING_NOTIFY:
+		/*
+		 * The other side moved head or tail through the mapping. Wake
+		 * up as read() or write() would have, which also arms the
+		 * max-delay timer for data that stays below high_watermark.
+		 * The waiting flags are left to their sleepers.
+		 */
+		used = awcloud_fifo_used_acquire(dev);
+		awcloud_fifo_wake_readers(dev, used, AWCLOUD_WAKE_NOTIFY);
+		awcloud_fifo_wake_writers(dev, used, AWCLOUD_WAKE_NOTIFY);
 		break;
 	default:
 		return -EINVAL;
@@ -192,15 +904,26 @@ static long ioctl_awcloud_fifo(struct file *filp,
 	return 0;
 }
 
+static long ioctl_awcloud_fifo(struct file *filp,
+	unsigned int cmd, unsigned long arg)
+{
+	unsigned int minor = iminor(file_inode(filp));
+	long ret;
+
+	trace_awcloud_ioctl_enter(minor, cmd, arg);
+	ret = awcloud_fifo_ioctl(filp, cmd, arg);
+	trace_awcloud_ioctl_exit(minor, cmd, ret);
+
+	return ret;
+}
+
 static loff_t llseek_awcloud_fifo(struct file *filp,
 	loff_t offset, int whence)
 {
 	loff_t ret = 0;
 	struct awcloud_fifo *dev = (struct awcloud_fifo *)filp->private_data;
 
-	pr_info(
-		"Calling the llseek function of this device,"
-		"and offset is %lld , whence is %d\n", offset, whence);
+	awcloud_dbg("seek", "offset %lld whence %d\n", offset, whence);
 	switch (whence) {
 	case SEEK_SET:
 		if (offset < 0) {
@@ -235,11 +958,11 @@ static loff_t llseek_awcloud_fifo(struct file *filp,
 			ret = -EINVAL;
 			break;
 		}
-		if ((dev->used_len+offset) > BUFFER_LEN) {
+		if ((awcloud_fifo_used(dev)+offset) > BUFFER_LEN) {
 			ret = -EINVAL;
 			break;
 		}
-		filp->f_pos = dev->used_len + offset;
+		filp->f_pos = awcloud_fifo_used(dev) + offset;
 		ret = filp->f_pos;
 		break;
 	default:
@@ -266,31 +989,238 @@ __poll_t poll_awcloud_fifo(
 	down(&dev->sem);
 	poll_wait(filp, &dev->r_wait, wait);
 	poll_wait(filp, &dev->w_wait, wait);
-	if (dev->used_len) {
+	if (awcloud_fifo_readable(dev, awcloud_fifo_used(dev))) {
 		mask |= POLLIN | POLLRDNORM;
 	}
-	if (BUFFER_LEN != dev->used_len) {
+	if (awcloud_fifo_writable(dev, awcloud_fifo_used(dev))) {
 		mask |= POLLOUT | POLLWRNORM;
 	}
+	trace_awcloud_poll(dev->minor, (__force unsigned int)mask,
+		awcloud_fifo_used(dev));
 	up(&dev->sem);
 
 	return mask;
 }
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+unsigned int poll_awcloud_fifo_spsc(
+	struct file *filp, struct poll_table_struct *wait)
+{
+	unsigned int mask = 0;
+#else
+__poll_t poll_awcloud_fifo_spsc(
+	struct file *filp, struct poll_table_struct *wait)
+{
+	__poll_t mask = 0;
+#endif
+	struct awcloud_fifo *dev = (struct awcloud_fifo *)filp->private_data;
+	unsigned int used;
+
+	poll_wait(filp, &dev->r_wait, wait);
+	poll_wait(filp, &dev->w_wait, wait);
+	if (filp->f_mode & FMODE_READ) {
+		WRITE_ONCE(dev->ring->reader_waiting, 1);
+	}
+	if (filp->f_mode & FMODE_WRITE) {
+		WRITE_ONCE(dev->ring->writer_waiting, 1);
+	}
+	smp_mb();
+	used = awcloud_fifo_used_acquire(dev);
+	if (awcloud_fifo_readable(dev, used)) {
+		mask |= POLLIN | POLLRDNORM;
+		if (filp->f_mode & FMODE_READ) {
+			WRITE_ONCE(dev->ring->reader_waiting, 0);
+		}
+	}
+	if (awcloud_fifo_writable(dev, used)) {
+		mask |= POLLOUT | POLLWRNORM;
+		if (filp->f_mode & FMODE_WRITE) {
+			WRITE_ONCE(dev->ring->writer_waiting, 0);
+		}
+	}
+	trace_awcloud_poll(dev->minor, (__force unsigned int)mask, used);
+
+	return mask;
+}
+
+static inline bool awcloud_fifo_vma_covers(struct vm_area_struct *vma,
+	unsigned long pgoff, unsigned long nr)
+{
+	return vma->vm_pgoff < pgoff + nr &&
+		pgoff < vma->vm_pgoff + vma_pages(vma);
+}
+
+/*
+ * Only the SPSC ring can be shared: with a single producer and a single
+ * consumer, each side may move its own index either through read()/write()
+ * or directly in the mapping, without a lock to coordinate with.
+ *
+ * A shared writable mapping may cover the head page and the data area
+ * only for the producer and the tail page only for the consumer; mapping
+ * them claims that side for the file. The control page is never writable.
+ * A shared read-only mapping loses VM_MAYWRITE, so mprotect() cannot get
+ * around these checks. Private mappings never write back to the ring.
+ */
+static int mmap_awcloud_fifo(struct file *filp, struct vm_area_struct *vma)
+{
+	struct awcloud_fifo *dev = (struct awcloud_fifo *)filp->private_data;
+
+	if (!(vma->vm_flags & VM_SHARED)) {
+		goto remap;
+	}
+	if (!(vma->vm_flags & VM_WRITE)) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+		vma->vm_flags &= ~VM_MAYWRITE;
+#else
+		vm_flags_clear(vma, VM_MAYWRITE);
+#endif
+		goto remap;
+	}
+
+	if (awcloud_fifo_vma_covers(vma, FIFO_RING_CTRL_PGOFF, 1)) {
+		return -EACCES;
+	}
+	if ((awcloud_fifo_vma_covers(vma, FIFO_RING_HEAD_PGOFF, 1) ||
+		awcloud_fifo_vma_covers(vma, FIFO_RING_DATA_PGOFF,
+			PAGE_ALIGN(BUFFER_LEN) >> PAGE_SHIFT)) &&
+		awcloud_fifo_claim(&dev->writer, filp)) {
+		return -EBUSY;
+	}
+	if (awcloud_fifo_vma_covers(vma, FIFO_RING_TAIL_PGOFF, 1) &&
+		awcloud_fifo_claim(&dev->reader, filp)) {
+		return -EBUSY;
+	}
+
+remap:
+	return remap_vmalloc_range(vma, dev->ring, vma->vm_pgoff);
+}
+
+#define AWCLOUD_FIFO_TUNABLE_ATTR(_name, _cmd)				\
+static ssize_t _name##_show(struct device *device,			\
+	struct device_attribute *attr, char *buf)			\
+{									\
+	struct awcloud_fifo *dev = dev_get_drvdata(device);		\
+									\
+	return sprintf(buf, "%u\n", READ_ONCE(dev->_name));		\
+}									\
+									\
+static ssize_t _name##_store(struct device *device,			\
+	struct device_attribute *attr, const char *buf, size_t count)	\
+{									\
+	struct awcloud_fifo *dev = dev_get_drvdata(device);		\
+	unsigned int value;						\
+	int ret;							\
+									\
+	ret = kstrtouint(buf, 0, &value);				\
+	if (!ret) {							\
+		ret = awcloud_fifo_set_tunable(dev, _cmd, value);	\
+	}								\
+	return ret ? ret : count;					\
+}									\
+static DEVICE_ATTR_RW(_name)
+
+AWCLOUD_FIFO_TUNABLE_ATTR(low_watermark, FIFO_SET_LOW_WATERMARK);
+AWCLOUD_FIFO_TUNABLE_ATTR(high_watermark, FIFO_SET_HIGH_WATERMARK);
+AWCLOUD_FIFO_TUNABLE_ATTR(max_delay_us, FIFO_SET_MAX_DELAY);
+
+static struct attribute *awcloud_fifo_attrs[] = {
+	&dev_attr_low_watermark.attr,
+	&dev_attr_high_watermark.attr,
+	&dev_attr_max_delay_us.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(awcloud_fifo);
+
+/*
+ * read_iter and write_iter of both modes wrap their handler in the entry
+ * and exit tracepoints. io is a constant at each call site, so this
+ * inlines down to a direct call, and the ring is only looked at for the
+ * exit event while it is enabled.
+ */
+static __always_inline ssize_t awcloud_fifo_traced_io(struct kiocb *iocb,
+	struct iov_iter *iter, bool write,
+	ssize_t (*io)(struct kiocb *, struct iov_iter *))
+{
+	struct awcloud_fifo *dev =
+		(struct awcloud_fifo *)iocb->ki_filp->private_data;
+	unsigned int minor = iminor(file_inode(iocb->ki_filp));
+	size_t count = iov_iter_count(iter);
+	ssize_t ret;
+
+	if (write) {
+		trace_awcloud_write_enter(minor, count, iocb->ki_pos);
+	} else {
+		trace_awcloud_read_enter(minor, count, iocb->ki_pos);
+	}
+	ret = io(iocb, iter);
+	if (write && trace_awcloud_write_exit_enabled()) {
+		trace_awcloud_write_exit(minor, ret, awcloud_fifo_used(dev));
+	} else if (!write && trace_awcloud_read_exit_enabled()) {
+		trace_awcloud_read_exit(minor, ret, awcloud_fifo_used(dev));
+	}
+
+	return ret;
+}
+
+static ssize_t read_iter_awcloud_fifo(struct kiocb *iocb, struct iov_iter *to)
+{
+	return awcloud_fifo_traced_io(iocb, to, false, awcloud_fifo_read);
+}
+
+static ssize_t write_iter_awcloud_fifo(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	return awcloud_fifo_traced_io(iocb, from, true, awcloud_fifo_write);
+}
+
+static ssize_t read_iter_awcloud_fifo_spsc(struct kiocb *iocb,
+	struct iov_iter *to)
+{
+	return awcloud_fifo_traced_io(iocb, to, false, awcloud_fifo_read_spsc);
+}
+
+static ssize_t write_iter_awcloud_fifo_spsc(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	return awcloud_fifo_traced_io(iocb, from, true,
+		awcloud_fifo_write_spsc);
+}
+
 static const struct file_operations awcloud_fifo_fops = {
 	.owner          = THIS_MODULE,
 	.open           = open_awcloud_fifo,
 	.release        = release_awcloud_fifo,
-	.read           = read_awcloud_fifo,
-	.write          = write_awcloud_fifo,
+	.read_iter      = read_iter_awcloud_fifo,
+	.write_iter     = write_iter_awcloud_fifo,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0)
+	.splice_read    = generic_file_splice_read,
+#else
+	.splice_read    = copy_splice_read,
+#endif
+	.splice_write   = iter_file_splice_write,
 	.llseek         = llseek_awcloud_fifo,
 	.poll           = poll_awcloud_fifo,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 0)
-	.ioctl          = ioctl_awcloud_fifo,
-#else
 	.compat_ioctl   = ioctl_awcloud_fifo,
 	.unlocked_ioctl = ioctl_awcloud_fifo,
+};
+
+static const struct file_operations awcloud_fifo_spsc_fops = {
+	.owner          = THIS_MODULE,
+	.open           = open_awcloud_fifo,
+	.release        = release_awcloud_fifo,
+	.read_iter      = read_iter_awcloud_fifo_spsc,
+	.write_iter     = write_iter_awcloud_fifo_spsc,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0)
+	.splice_read    = generic_file_splice_read,
+#else
+	.splice_read    = copy_splice_read,
 #endif
+	.splice_write   = iter_file_splice_write,
+	.llseek         = llseek_awcloud_fifo,
+	.poll           = poll_awcloud_fifo_spsc,
+	.mmap           = mmap_awcloud_fifo,
+	.compat_ioctl   = ioctl_awcloud_fifo,
+	.unlocked_ioctl = ioctl_awcloud_fifo,
 };
 
 static int awcloud_fifo_setup_chrdev(struct awcloud_fifo *dev)
@@ -321,7 +1251,11 @@ static int awcloud_fifo_setup_chrdev(struct awcloud_fifo *dev)
 
 	dev->cdev->owner = THIS_MODULE;
 
-	cdev_init(dev->cdev, &awcloud_fifo_fops);
+	if (spsc) {
+		cdev_init(dev->cdev, &awcloud_fifo_spsc_fops);
+	} else {
+		cdev_init(dev->cdev, &awcloud_fifo_fops);
+	}
 
 	result = cdev_add(dev->cdev, dev->dev_id, 1);
 	if (result) {
@@ -336,21 +1270,17 @@ static int awcloud_fifo_setup_chrdev(struct awcloud_fifo *dev)
 		goto class_create_err;
 	}
 
-	dev->device = device_create(dev->class, NULL,
-		dev->dev_id, NULL, DEV_NAME);
+	dev->device = device_create_with_groups(dev->class, NULL,
+		dev->dev_id, dev, awcloud_fifo_groups, DEV_NAME);
 	if (IS_ERR(dev->device)) {
 		result = PTR_ERR(dev->device);
 		goto device_create_err;
 	}
 
-	memset(dev->buffer, 0, BUFFER_LEN);
-	dev->used_len = 0;
-#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 36) && !defined(init_MUTEX)
 	sema_init(&(dev->sem), 1);
-#else
-	init_MUTEX(&(dev->sem));
-#endif
 
+	mutex_init(&dev->r_lock);
+	mutex_init(&dev->w_lock);
 	init_waitqueue_head(&dev->r_wait);
 	init_waitqueue_head(&dev->w_wait);
 	return 0;
@@ -370,13 +1300,36 @@ static int __init awcloud_fifo_init(void)
 {
 	int result = 0;
 
+	BUILD_BUG_ON_NOT_POWER_OF_2(BUFFER_LEN);
+
 	dev = kzalloc(sizeof(struct awcloud_fifo), GFP_KERNEL);
 	if (!dev) {
 		result = -ENOMEM;
 		goto finally;
 	}
+
+	dev->ring = vmalloc_user(sizeof(struct awcloud_fifo_ring) +
+		PAGE_ALIGN(BUFFER_LEN));
+	if (!dev->ring) {
+		kfree(dev);
+		result = -ENOMEM;
+		goto finally;
+	}
+	dev->ring->size = BUFFER_LEN;
+	dev->data = (char *)(dev->ring + 1);
+
+	dev->low_watermark = BUFFER_LEN - 1;
+	dev->high_watermark = 1;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+	hrtimer_init(&dev->delay_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dev->delay_timer.function = awcloud_fifo_delay_handler;
+#else
+	hrtimer_setup(&dev->delay_timer, awcloud_fifo_delay_handler,
+		CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#endif
 	result = awcloud_fifo_setup_chrdev(dev);
 	if (0 > result) {
+		vfree(dev->ring);
 		kfree(dev);
 		goto finally;
 	}
@@ -391,6 +1344,8 @@ static void __exit awcloud_fifo_exit(void)
 	class_destroy(dev->class);
 	cdev_del(dev->cdev);
 	unregister_chrdev_region(dev->dev_id, 1);
+	hrtimer_cancel(&dev->delay_timer);
+	vfree(dev->ring);
 	kfree(dev);
 }
 
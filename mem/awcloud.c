@@ -3,35 +3,256 @@
 #include <linux/fs.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/xarray.h>
+#include <linux/rwsem.h>
+#include <linux/pagemap.h>
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
 #include <linux/device.h>
 #endif
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+/*
+ * Debug messages, off unless enabled through dynamic debug and rate
+ * limited when on. Each one starts with its category (io, seek, ioctl)
+ * so a category can be switched on by itself, e.g.
+ *   echo 'module awcloud format "io: " +p' > /proc/dynamic_debug/control
+ */
+#define awcloud_dbg(cat, fmt, ...) \
+	pr_debug_ratelimited(cat ": " fmt, ##__VA_ARGS__)
+
 #define DEV_NAME "awcloud"
-#define BUFFER_LEN 4096
+#define DEFAULT_CAPACITY (1UL << 30)
 #define MEM_CLEAR 0x1
-
+#define MEM_RESIZE 0x2
+
+/*
+ * The device memory is a sparse array of pages indexed by page offset.
+ * A page only exists once something has been written to it (or it has
+ * been faulted into a mapping); holes read back as zeroes. capacity
+ * starts out as the module parameter and can be changed with MEM_RESIZE.
+ *
+ * resize_lock is held shared by everything that adds pages, write() and
+ * the fault handlers, and exclusively by MEM_RESIZE and MEM_CLEAR, so no
+ * page can be added behind a capacity that is being shrunk.
+ *
+ * Read faults on a hole map hole_page, one zeroed page shared by every
+ * hole that is never written to, instead of allocating memory.
+ */
 struct awcloud_mem {
 	dev_t             dev_id;
 	unsigned int      major;
 	unsigned int      minor;
-	unsigned int      used_len;
+	loff_t            used_len;
+	unsigned long     capacity;
 	struct device     *device;
 	struct class      *class;
 	struct cdev       *cdev;
-	char              buffer[BUFFER_LEN];
+	struct xarray     pages;
+	struct rw_semaphore resize_lock;
+	struct page       *hole_page;
 };
 
 static struct awcloud_mem *dev;
 static unsigned int major;
+static unsigned long capacity = DEFAULT_CAPACITY;
 module_param(major, uint, 0444);
+module_param(capacity, ulong, 0444);
+MODULE_PARM_DESC(capacity, "Initial size of the device memory in bytes");
+
+/*
+ * MEM_CLEAR may drop a page while a reader is still looking it up, so the
+ * reference is taken speculatively and the slot checked again afterwards,
+ * the same way the page cache does it.
+ */
+static struct page *awcloud_mem_get_page(struct awcloud_mem *dev,
+	pgoff_t index)
+{
+	struct page *page;
+
+	rcu_read_lock();
+repeat:
+	page = xa_load(&dev->pages, index);
+	if (page) {
+		if (!get_page_unless_zero(page)) {
+			goto repeat;
+		}
+		if (unlikely(page != xa_load(&dev->pages, index))) {
+			put_page(page);
+			goto repeat;
+		}
+	}
+	rcu_read_unlock();
+
+	return page;
+}
+
+/*
+ * A new page replaces the hole at index, so hole_page must not stay mapped
+ * there. Faults mapping hole_page hold its lock until the page table
+ * entry is installed, so taking it waits for those in flight before the
+ * range is unmapped; faults starting later find the new page.
+ */
+static void awcloud_mem_fill_hole(struct awcloud_mem *dev,
+	struct address_space *mapping, pgoff_t index)
+{
+	lock_page(dev->hole_page);
+	unlock_page(dev->hole_page);
+	if (mapping_mapped(mapping)) {
+		unmap_mapping_range(mapping, (loff_t)index << PAGE_SHIFT,
+			PAGE_SIZE, 0);
+	}
+}
+
+static struct page *awcloud_mem_alloc_page(struct awcloud_mem *dev,
+	struct address_space *mapping, pgoff_t index, gfp_t gfp)
+{
+	struct page *page;
+	struct page *old;
+
+	for (;;) {
+		page = awcloud_mem_get_page(dev, index);
+		if (page) {
+			return page;
+		}
+
+		page = alloc_page(gfp | __GFP_ZERO);
+		if (!page) {
+			return ERR_PTR(-ENOMEM);
+		}
+
+		/* One reference for the xarray, one for the caller */
+		get_page(page);
+		old = xa_cmpxchg(&dev->pages, index, NULL, page, gfp);
+		if (!old) {
+			awcloud_mem_fill_hole(dev, mapping, index);
+			return page;
+		}
+
+		put_page(page);
+		put_page(page);
+		if (xa_is_err(old)) {
+			return ERR_PTR(xa_err(old));
+		}
+	}
+}
+
+/*
+ * The fault handler returns its page locked and only unlocks it once the
+ * page table entry is in place. Taking the lock of each erased page
+ * therefore waits for faults still installing it.
+ */
+static void awcloud_mem_free_pages(struct awcloud_mem *dev, pgoff_t start)
+{
+	struct page *page;
+	unsigned long index;
+
+	xa_for_each(&dev->pages, index, page) {
+		if (index < start) {
+			continue;
+		}
+		xa_erase(&dev->pages, index);
+		lock_page(page);
+		unlock_page(page);
+		put_page(page);
+	}
+}
+
+/*
+ * Drop every page from start on, like truncate_pagecache(): unmap, free,
+ * then unmap again for faults that were installing a page meanwhile.
+ * Called with resize_lock held exclusively.
+ */
+static void awcloud_mem_truncate(struct awcloud_mem *dev,
+	struct address_space *mapping, pgoff_t start)
+{
+	loff_t holebegin = (loff_t)start << PAGE_SHIFT;
+
+	unmap_mapping_range(mapping, holebegin, 0, 1);
+	awcloud_mem_free_pages(dev, start);
+	unmap_mapping_range(mapping, holebegin, 0, 1);
+}
+
+/*
+ * Shrinking works like truncate: with resize_lock held exclusively no
+ * write or fault is adding pages, so the new capacity is published, pages
+ * past it are dropped and the tail of the last partial page is zeroed,
+ * and growing the device again never brings old bytes back. Readers keep
+ * using the RCU page lookup and simply see a hole, or stop at the
+ * clamped used_len.
+ */
+static int awcloud_mem_resize(struct awcloud_mem *dev,
+	struct address_space *mapping, unsigned long size)
+{
+	struct page *page;
+
+	if (!size || size > MAX_LFS_FILESIZE) {
+		return -EINVAL;
+	}
+
+	down_write(&dev->resize_lock);
+
+	WRITE_ONCE(dev->capacity, size);
+	if (dev->used_len > (loff_t)size) {
+		WRITE_ONCE(dev->used_len, size);
+	}
+
+	awcloud_mem_truncate(dev, mapping, DIV_ROUND_UP(size, PAGE_SIZE));
+
+	if (offset_in_page(size)) {
+		page = awcloud_mem_get_page(dev, size >> PAGE_SHIFT);
+		if (page) {
+			zero_user_segment(page, offset_in_page(size),
+				PAGE_SIZE);
+			put_page(page);
+		}
+	}
+
+	up_write(&dev->resize_lock);
+
+	return 0;
+}
+
+/*
+ * Make the next bytes of the source readable with resize_lock dropped.
+ * Returns 0 if at least some progress can be made.
+ */
+static int awcloud_mem_fault_in(struct iov_iter *from, size_t bytes)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 16, 0)
+	return iov_iter_fault_in_readable(from, bytes);
+#else
+	return fault_in_iov_iter_readable(from, bytes) == bytes ? -EFAULT : 0;
+#endif
+}
+
+/* Concurrent writers and write faults may race to move used_len forward */
+static void awcloud_mem_extend(struct awcloud_mem *dev, loff_t end)
+{
+	loff_t used = READ_ONCE(dev->used_len);
+	loff_t old;
+
+	while (end > used) {
+		old = cmpxchg64(&dev->used_len, used, end);
+		if (old == used) {
+			break;
+		}
+		used = old;
+	}
+}
 
 static int open_awcloud_mem(struct inode *inodep, struct file *filp)
 {
+#ifdef FMODE_NOWAIT
+	filp->f_mode |= FMODE_NOWAIT;
+#endif
 	filp->private_data = dev;
 	return 0;
 }
@@ -41,161 +262,382 @@ static int release_awcloud_mem(struct inode *inodep, struct file *filp)
 	return 0;
 }
 
-static ssize_t read_awcloud_mem(struct file *filp,
-	char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t awcloud_mem_read(struct kiocb *iocb, struct iov_iter *to)
 {
-	int ret = 0;
-	struct awcloud_mem *dev = (struct awcloud_mem *)filp->private_data;
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(to);
+	loff_t pos = iocb->ki_pos;
+	loff_t used_len;
+	struct page *page;
+	struct awcloud_mem *dev =
+		(struct awcloud_mem *)iocb->ki_filp->private_data;
+
+	/* Nothing to copy is not a fault, whatever the position */
+	if (!count) {
+		return 0;
+	}
 
-	if (*ppos >= BUFFER_LEN) {
-		return count ? -ENXIO:0;
+	used_len = min_t(loff_t, READ_ONCE(dev->used_len),
+		READ_ONCE(dev->capacity));
+	if (pos >= used_len) {
+		return 0;
 	}
 
-	if (count > (BUFFER_LEN - *ppos)) {
-		count = BUFFER_LEN - *ppos;
+	if (count > used_len - pos) {
+		count = used_len - pos;
+	}
+
+	while (count) {
+		size_t offset = offset_in_page(pos);
+		size_t bytes = min_t(size_t, PAGE_SIZE - offset, count);
+		size_t copied;
+
+		page = awcloud_mem_get_page(dev, pos >> PAGE_SHIFT);
+		if (page) {
+			copied = copy_page_to_iter(page, offset, bytes, to);
+			put_page(page);
+		} else {
+			copied = iov_iter_zero(bytes, to);
+		}
+
+		ret += copied;
+		pos += copied;
+		if (copied < bytes) {
+			break;
+		}
+		count -= bytes;
 	}
 
-	if (copy_to_user(user_buffer, (void *)(dev->buffer + *ppos), count)) {
+	if (!ret) {
 		return -EFAULT;
 	}
 
-	*ppos += count;
-	ret = count;
+	iocb->ki_pos = pos;
 
 	return ret;
 }
 
-static ssize_t write_awcloud_mem(struct file *filp,
-	const char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t read_iter_awcloud_mem(struct kiocb *iocb, struct iov_iter *to)
 {
-	int ret = 0;
+	struct file *filp = iocb->ki_filp;
 	struct awcloud_mem *dev = (struct awcloud_mem *)filp->private_data;
+	unsigned int minor = iminor(file_inode(filp));
+	ssize_t ret;
+
+	trace_awcloud_read_enter(minor, iov_iter_count(to), iocb->ki_pos);
+	ret = awcloud_mem_read(iocb, to);
+	trace_awcloud_read_exit(minor, ret, dev->used_len);
+
+	return ret;
+}
 
-	if (*ppos >= BUFFER_LEN) {
-		return count ? -ENXIO:0;
+static ssize_t awcloud_mem_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	ssize_t ret = 0;
+	int err = -EFAULT;
+	size_t count = iov_iter_count(from);
+	loff_t pos = iocb->ki_pos;
+	gfp_t gfp = GFP_KERNEL;
+	unsigned long capacity;
+	struct page *page;
+	struct awcloud_mem *dev =
+		(struct awcloud_mem *)iocb->ki_filp->private_data;
+
+	if (!count) {
+		return 0;
 	}
 
-	if (count > BUFFER_LEN - *ppos) {
-		count = BUFFER_LEN - *ppos;
+	awcloud_dbg("io", "write %zu bytes at %lld\n", count, pos);
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!down_read_trylock(&dev->resize_lock)) {
+			return -EAGAIN;
+		}
+		gfp = GFP_NOWAIT;
+	} else {
+		down_read(&dev->resize_lock);
 	}
 
-	pr_info(
-#if defined(__arm__)
-		"Calling the write function with count %d, and ppos %lld\n",
-#else
-		"Calling the write function with count %ld, and ppos %lld\n",
-#endif
-		count, *ppos);
+	while (count) {
+		size_t offset = offset_in_page(pos);
+		size_t bytes = min_t(size_t, PAGE_SIZE - offset, count);
+		size_t copied;
+
+		capacity = dev->capacity;
+		if (pos >= capacity) {
+			err = -ENXIO;
+			break;
+		}
+		if (bytes > capacity - pos) {
+			bytes = capacity - pos;
+		}
 
-	if (copy_from_user(dev->buffer + *ppos, user_buffer, count)) {
-		ret = -EFAULT;
-		return ret;
+		page = awcloud_mem_alloc_page(dev, iocb->ki_filp->f_mapping,
+			pos >> PAGE_SHIFT, gfp);
+		if (IS_ERR(page)) {
+			err = gfp == GFP_NOWAIT ? -EAGAIN : PTR_ERR(page);
+			break;
+		}
+
+		/*
+		 * The source may be a mapping of this very device, whose
+		 * fault handler takes resize_lock as well. Copy without
+		 * faulting and fault the rest in with the lock dropped.
+		 */
+		pagefault_disable();
+		copied = copy_page_from_iter(page, offset, bytes, from);
+		pagefault_enable();
+		put_page(page);
+
+		ret += copied;
+		pos += copied;
+		count -= copied;
+		if (copied < bytes) {
+			if (gfp == GFP_NOWAIT) {
+				err = -EAGAIN;
+				break;
+			}
+			up_read(&dev->resize_lock);
+			err = awcloud_mem_fault_in(from, bytes - copied);
+			down_read(&dev->resize_lock);
+			if (err) {
+				break;
+			}
+		}
 	}
 
-	*ppos += count;
-	if (*ppos > dev->used_len) {
-		dev->used_len = *ppos;
+	if (ret) {
+		iocb->ki_pos = pos;
+		awcloud_mem_extend(dev, pos);
 	}
-	ret = count;
 
-	return ret;
+	up_read(&dev->resize_lock);
+
+	return ret ? ret : err;
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
-int ioctl_awcloud_mem(struct inode *inodep,
-	struct file *filp, unsigned int cmd, unsigned long arg)
+static ssize_t write_iter_awcloud_mem(struct kiocb *iocb, struct iov_iter *from)
 {
-#else
-static long ioctl_awcloud_mem(struct file *filp,
-	unsigned int cmd, unsigned long arg)
+	struct file *filp = iocb->ki_filp;
+	struct awcloud_mem *dev = (struct awcloud_mem *)filp->private_data;
+	unsigned int minor = iminor(file_inode(filp));
+	ssize_t ret;
+
+	trace_awcloud_write_enter(minor, iov_iter_count(from), iocb->ki_pos);
+	ret = awcloud_mem_write(iocb, from);
+	trace_awcloud_write_exit(minor, ret, dev->used_len);
+
+	return ret;
+}
+
+static long awcloud_mem_ioctl(struct file *filp, unsigned int cmd,
+	unsigned long arg)
 {
-	//struct inode *inodep = file_inode(filp);
-#endif
 	struct awcloud_mem *dev = (struct awcloud_mem *)filp->private_data;
 
 	switch (cmd) {
 	case MEM_CLEAR:
-		memset(dev->buffer, 0, BUFFER_LEN);
-		dev->used_len = 0;
-		pr_info("Set Kernel Buffer to Zero\n");
+		down_write(&dev->resize_lock);
+		awcloud_mem_truncate(dev, filp->f_mapping, 0);
+		WRITE_ONCE(dev->used_len, 0);
+		up_write(&dev->resize_lock);
+		awcloud_dbg("ioctl", "buffer cleared\n");
 		break;
+	case MEM_RESIZE:
+		return awcloud_mem_resize(dev, filp->f_mapping, arg);
 	default:
 		return -EINVAL;
 	}
 	return 0;
 }
 
+static long ioctl_awcloud_mem(struct file *filp,
+	unsigned int cmd, unsigned long arg)
+{
+	unsigned int minor = iminor(file_inode(filp));
+	long ret;
+
+	trace_awcloud_ioctl_enter(minor, cmd, arg);
+	ret = awcloud_mem_ioctl(filp, cmd, arg);
+	trace_awcloud_ioctl_exit(minor, cmd, ret);
+
+	return ret;
+}
+
 static loff_t llseek_awcloud_mem(struct file *filp,
 	loff_t offset, int whence)
 {
 	loff_t ret = 0;
 	struct awcloud_mem *dev = (struct awcloud_mem *)filp->private_data;
 
-	pr_info(
-		"Calling the llseek function of this device,"
-		"and offset is %lld , whence is %d\n", offset, whence);
+	awcloud_dbg("seek", "offset %lld whence %d\n", offset, whence);
 	switch (whence) {
 	case SEEK_SET:
-		if (offset < 0) {
-			ret = -EINVAL;
-			break;
-		}
-		if ((unsigned int)offset > BUFFER_LEN) {
-			ret = -EINVAL;
-			break;
-		}
-		filp->f_pos = (unsigned int) offset;
-		ret = filp->f_pos;
 		break;
 	case SEEK_CUR:
-		if ((filp->f_pos + offset) > BUFFER_LEN) {
-			ret = -EINVAL;
-			break;
-		}
-		if ((filp->f_pos + offset) < 0) {
-			ret = -EINVAL;
-			break;
-		}
-		filp->f_pos += offset;
-		ret = filp->f_pos;
+		offset += filp->f_pos;
 		break;
 	case SEEK_END:
-		if ((filp->f_pos + offset) > BUFFER_LEN) {
-			ret = -EINVAL;
-			break;
-		}
-		if ((filp->f_pos + offset) < 0) {
-			ret = -EINVAL;
-			break;
-		}
-		if ((dev->used_len+offset) > BUFFER_LEN) {
-			ret = -EINVAL;
-			break;
-		}
-		filp->f_pos = dev->used_len + offset;
-		ret = filp->f_pos;
+		offset += READ_ONCE(dev->used_len);
 		break;
 	default:
+		return -EINVAL;
+	}
+
+	if (offset < 0 || offset > READ_ONCE(dev->capacity)) {
 		ret = -EINVAL;
-		break;
+	} else {
+		filp->f_pos = offset;
+		ret = filp->f_pos;
 	}
 
 	return ret;
 }
 
+/*
+ * A write fault on a shared mapping allocates the page just like a write
+ * would, so shared mappings and read()/write() always see the same
+ * bytes. Any other fault on a hole, a read or the copy-on-write source of
+ * a private mapping, gets hole_page instead; page_mkwrite swaps it for a
+ * real page on the first store through a shared mapping.
+ */
+static vm_fault_t fault_awcloud_mem(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct awcloud_mem *dev = (struct awcloud_mem *)vma->vm_private_data;
+	struct page *page;
+	unsigned long capacity;
+
+	down_read(&dev->resize_lock);
+
+	capacity = dev->capacity;
+	if (vmf->pgoff >= DIV_ROUND_UP(capacity, PAGE_SIZE)) {
+		up_read(&dev->resize_lock);
+		return VM_FAULT_SIGBUS;
+	}
+
+	if (!(vmf->flags & FAULT_FLAG_WRITE) || !(vma->vm_flags & VM_SHARED)) {
+		lock_page(dev->hole_page);
+		page = awcloud_mem_get_page(dev, vmf->pgoff);
+		if (!page) {
+			get_page(dev->hole_page);
+			up_read(&dev->resize_lock);
+			vmf->page = dev->hole_page;
+			return VM_FAULT_LOCKED;
+		}
+		unlock_page(dev->hole_page);
+	} else {
+		page = awcloud_mem_alloc_page(dev, vma->vm_file->f_mapping,
+			vmf->pgoff, GFP_KERNEL);
+		if (IS_ERR(page)) {
+			up_read(&dev->resize_lock);
+			return VM_FAULT_OOM;
+		}
+	}
+	/* Keeps a resize from freeing the page before it is mapped */
+	lock_page(page);
+
+	up_read(&dev->resize_lock);
+	vmf->page = page;
+
+	return VM_FAULT_LOCKED;
+}
+
+/*
+ * Shared mappings are write protected until the first store to a page,
+ * which comes through here whether the page was faulted in for reading
+ * or writing: this is where a mapping moves used_len forward, so read()
+ * returns what was stored through it.
+ */
+static vm_fault_t mkwrite_awcloud_mem(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct awcloud_mem *dev = (struct awcloud_mem *)vma->vm_private_data;
+	struct page *page = vmf->page;
+	unsigned long capacity;
+	loff_t end;
+
+	down_read(&dev->resize_lock);
+
+	capacity = dev->capacity;
+	if (vmf->pgoff >= DIV_ROUND_UP(capacity, PAGE_SIZE)) {
+		up_read(&dev->resize_lock);
+		return VM_FAULT_SIGBUS;
+	}
+
+	if (page == dev->hole_page) {
+		/*
+		 * Allocating the page unmaps hole_page from this offset in
+		 * every mapping, this one included; the retried fault then
+		 * maps the new page.
+		 */
+		page = awcloud_mem_alloc_page(dev, vma->vm_file->f_mapping,
+			vmf->pgoff, GFP_KERNEL);
+		up_read(&dev->resize_lock);
+		if (IS_ERR(page)) {
+			return VM_FAULT_OOM;
+		}
+		put_page(page);
+		return VM_FAULT_NOPAGE;
+	}
+
+	lock_page(page);
+	if (xa_load(&dev->pages, vmf->pgoff) != page) {
+		/* Dropped by MEM_CLEAR or a resize, fault it in again */
+		unlock_page(page);
+		up_read(&dev->resize_lock);
+		return VM_FAULT_NOPAGE;
+	}
+
+	end = min_t(loff_t, (loff_t)(vmf->pgoff + 1) << PAGE_SHIFT, capacity);
+	awcloud_mem_extend(dev, end);
+
+	up_read(&dev->resize_lock);
+
+	return VM_FAULT_LOCKED;
+}
+
+static const struct vm_operations_struct awcloud_mem_vm_ops = {
+	.fault        = fault_awcloud_mem,
+	.page_mkwrite = mkwrite_awcloud_mem,
+};
+
+static int mmap_awcloud_mem(struct file *filp, struct vm_area_struct *vma)
+{
+	struct awcloud_mem *dev = (struct awcloud_mem *)filp->private_data;
+	unsigned long pages = DIV_ROUND_UP(READ_ONCE(dev->capacity), PAGE_SIZE);
+
+	if (vma->vm_pgoff >= pages || vma_pages(vma) > pages - vma->vm_pgoff) {
+		return -EINVAL;
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0)
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#else
+	vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#endif
+	vma->vm_ops = &awcloud_mem_vm_ops;
+	vma->vm_private_data = dev;
+
+	return 0;
+}
+
 static const struct file_operations awcloud_mem_fops = {
-	.owner   = THIS_MODULE,
-	.open    = open_awcloud_mem,
-	.release = release_awcloud_mem,
-	.read    = read_awcloud_mem,
-	.write   = write_awcloud_mem,
-	.llseek  = llseek_awcloud_mem,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 0)
-	.ioctl   = ioctl_awcloud_mem,
+	.owner          = THIS_MODULE,
+	.open           = open_awcloud_mem,
+	.release        = release_awcloud_mem,
+	.read_iter      = read_iter_awcloud_mem,
+	.write_iter     = write_iter_awcloud_mem,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 5, 0)
+	.splice_read    = generic_file_splice_read,
 #else
-	.compat_ioctl = ioctl_awcloud_mem,
-	.unlocked_ioctl = ioctl_awcloud_mem,
+	.splice_read    = copy_splice_read,
 #endif
+	.splice_write   = iter_file_splice_write,
+	.llseek         = llseek_awcloud_mem,
+	.mmap           = mmap_awcloud_mem,
+	.compat_ioctl   = ioctl_awcloud_mem,
+	.unlocked_ioctl = ioctl_awcloud_mem,
 };
 
 static int awcloud_mem_setup_chrdev(struct awcloud_mem *dev)
@@ -248,7 +690,6 @@ static int awcloud_mem_setup_chrdev(struct awcloud_mem *dev)
 		goto device_create_err;
 	}
 
-	memset(dev->buffer, 0, BUFFER_LEN);
 	dev->used_len = 0;
 	return 0;
 
@@ -267,13 +708,30 @@ static int __init awcloud_mem_init(void)
 {
 	int result = 0;
 
+	if (!capacity) {
+		result = -EINVAL;
+		goto finally;
+	}
+
 	dev = kzalloc(sizeof(struct awcloud_mem), GFP_KERNEL);
 	if (!dev) {
 		result = -ENOMEM;
 		goto finally;
 	}
+
+	dev->hole_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (!dev->hole_page) {
+		kfree(dev);
+		result = -ENOMEM;
+		goto finally;
+	}
+
+	xa_init(&dev->pages);
+	init_rwsem(&dev->resize_lock);
+	dev->capacity = capacity;
 	result = awcloud_mem_setup_chrdev(dev);
 	if (0 > result) {
+		put_page(dev->hole_page);
 		kfree(dev);
 		goto finally;
 	}
@@ -288,6 +746,9 @@ static void __exit awcloud_mem_exit(void)
 	class_destroy(dev->class);
 	cdev_del(dev->cdev);
 	unregister_chrdev_region(dev->dev_id, 1);
+	awcloud_mem_free_pages(dev, 0);
+	xa_destroy(&dev->pages);
+	put_page(dev->hole_page);
 	kfree(dev);
 }
 
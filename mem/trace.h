@@ -0,0 +1,124 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM awcloud_mem
+
+#if !defined(_AWCLOUD_MEM_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AWCLOUD_MEM_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(awcloud_io_enter,
+
+	TP_PROTO(unsigned int minor, size_t count, loff_t pos),
+
+	TP_ARGS(minor, count, pos),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(size_t, count)
+		__field(loff_t, pos)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->count = count;
+		__entry->pos = pos;
+	),
+
+	TP_printk("minor=%u count=%zu pos=%lld",
+		__entry->minor, __entry->count, __entry->pos)
+);
+
+DECLARE_EVENT_CLASS(awcloud_io_exit,
+
+	TP_PROTO(unsigned int minor, ssize_t ret, size_t used_len),
+
+	TP_ARGS(minor, ret, used_len),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(ssize_t, ret)
+		__field(size_t, used_len)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->ret = ret;
+		__entry->used_len = used_len;
+	),
+
+	TP_printk("minor=%u ret=%zd used_len=%zu",
+		__entry->minor, __entry->ret, __entry->used_len)
+);
+
+DEFINE_EVENT(awcloud_io_enter, awcloud_read_enter,
+	TP_PROTO(unsigned int minor, size_t count, loff_t pos),
+	TP_ARGS(minor, count, pos)
+);
+
+DEFINE_EVENT(awcloud_io_exit, awcloud_read_exit,
+	TP_PROTO(unsigned int minor, ssize_t ret, size_t used_len),
+	TP_ARGS(minor, ret, used_len)
+);
+
+DEFINE_EVENT(awcloud_io_enter, awcloud_write_enter,
+	TP_PROTO(unsigned int minor, size_t count, loff_t pos),
+	TP_ARGS(minor, count, pos)
+);
+
+DEFINE_EVENT(awcloud_io_exit, awcloud_write_exit,
+	TP_PROTO(unsigned int minor, ssize_t ret, size_t used_len),
+	TP_ARGS(minor, ret, used_len)
+);
+
+TRACE_EVENT(awcloud_ioctl_enter,
+
+	TP_PROTO(unsigned int minor, unsigned int cmd, unsigned long arg),
+
+	TP_ARGS(minor, cmd, arg),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, cmd)
+		__field(unsigned long, arg)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->cmd = cmd;
+		__entry->arg = arg;
+	),
+
+	TP_printk("minor=%u cmd=0x%x arg=0x%lx",
+		__entry->minor, __entry->cmd, __entry->arg)
+);
+
+TRACE_EVENT(awcloud_ioctl_exit,
+
+	TP_PROTO(unsigned int minor, unsigned int cmd, long ret),
+
+	TP_ARGS(minor, cmd, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(unsigned int, cmd)
+		__field(long, ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->cmd = cmd;
+		__entry->ret = ret;
+	),
+
+	TP_printk("minor=%u cmd=0x%x ret=%ld",
+		__entry->minor, __entry->cmd, __entry->ret)
+);
+
+#endif /* _AWCLOUD_MEM_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+
+#include <trace/define_trace.h>
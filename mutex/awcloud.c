@@ -4,147 +4,782 @@
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/rwsem.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
 #include <linux/device.h>
 #endif
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+/*
+ * Debug messages, off unless enabled through dynamic debug and rate
+ * limited when on. Each one starts with its category (io, seek, ioctl)
+ * so a category can be switched on by itself, e.g.
+ *   echo 'module awcloud format "io: " +p' > /proc/dynamic_debug/control
+ */
+#define awcloud_dbg(cat, fmt, ...) \
+	pr_debug_ratelimited(cat ": " fmt, ##__VA_ARGS__)
+
 #define DEV_NAME "awcloud"
 #define BUFFER_LEN 4096
+#define MAX_BUFFER_LEN (1 << 20)
+#define MAX_STRIPES 16
 #define MEM_CLEAR 0x1
+#define MEM_RESIZE 0x2
+#define SEQ_STACK_LEN 256
+#define LOCK_STATS_RESET 0x3
+#define STAT_BUCKETS 32
+
+/*
+ * One published version of the buffer in rcu mode. Readers copy out of it
+ * inside an rcu read-side section without touching it, so a replaced
+ * version is freed after a grace period rather than on a last reference.
+ */
+struct awcloud_mutex_buf {
+	struct rcu_head   rcu;
+	unsigned int      len;
+	char              data[];
+};
+
+/*
+ * Lock statistics, exported through debugfs. Taking the stripes for one
+ * access counts as one acquisition: its wait runs from the first attempt
+ * until the whole range is held, and its hold from then until the range
+ * is released. Histogram bucket n counts durations in [2^n, 2^(n+1)) ns.
+ */
+struct awcloud_mutex_stats {
+	atomic64_t        acquisitions;
+	atomic64_t        contended;
+	atomic64_t        wait_ns;
+	atomic64_t        hold_ns;
+	atomic64_t        wait_hist[STAT_BUCKETS];
+	atomic64_t        hold_hist[STAT_BUCKETS];
+};
 
 struct awcloud_mutex {
 	dev_t             dev_id;
 	unsigned int      major;
 	unsigned int      minor;
 	unsigned int      used_len;
+	unsigned int      size;
 	struct device     *device;
 	struct class      *class;
 	struct cdev       *cdev;
-	char              buffer[BUFFER_LEN];
-	struct mutex      mutex;
+	struct mutex      mutex[MAX_STRIPES];
+	struct rw_semaphore rwsem[MAX_STRIPES];
+	struct awcloud_mutex_stats stats;
+	struct dentry     *debugfs;
+	seqcount_t        seq;
+	struct awcloud_mutex_buf __rcu *buf;
+	/* BUFFER_LEN bytes, except in rcu mode where versions hold the data */
+	char              buffer[];
+};
+
+/*
+ * Per open file state. In rcu mode a reader snapshots the version it sees
+ * into bounce before copying out to user space, which may fault and so
+ * cannot happen under rcu_read_lock(). busy guards it against threads
+ * sharing the file; the loser falls back to kmalloc. Other modes do not
+ * allocate bounce.
+ */
+struct awcloud_mutex_file {
+	struct awcloud_mutex *dev;
+	unsigned long     busy;
+	char              bounce[];
 };
 
 static struct awcloud_mutex *dev;
 static unsigned int major;
+static bool rwsem;
+static unsigned int stripes = 1;
+static unsigned int stripe_shift;
+static bool lock_stats;
+static bool seqlock;
+static bool rcu;
 module_param(major, uint, 0444);
+module_param(rwsem, bool, 0444);
+MODULE_PARM_DESC(rwsem, "Let readers share the buffer through an rw_semaphore");
+module_param(stripes, uint, 0444);
+MODULE_PARM_DESC(stripes, "Number of range lock stripes, a power of two <= 16");
+module_param(lock_stats, bool, 0644);
+MODULE_PARM_DESC(lock_stats, "Record lock wait and hold times in debugfs");
+module_param(seqlock, bool, 0444);
+MODULE_PARM_DESC(seqlock, "Read the buffer locklessly under a seqcount");
+module_param(rcu, bool, 0444);
+MODULE_PARM_DESC(rcu, "Publish buffer versions through RCU, allows MEM_RESIZE");
+
+/* Each stripe gets its own lockdep class so they can be nested */
+static struct lock_class_key awcloud_mutex_stripe_keys[MAX_STRIPES];
+static struct lock_class_key awcloud_mutex_rwsem_keys[MAX_STRIPES];
+
+/*
+ * The buffer is split into stripes equal ranges with one lock each. An
+ * access takes the stripes it overlaps in ascending order, so accesses to
+ * disjoint ranges run in parallel and overlapping ones cannot deadlock;
+ * MEM_CLEAR simply covers every stripe. With rwsem set, readers hold their
+ * stripes shared and only writers exclude each other.
+ */
+static void awcloud_mutex_stripe_range(loff_t pos, size_t count,
+	unsigned int *first, unsigned int *last)
+{
+	loff_t end = count ? pos + count - 1 : pos;
+
+	*first = min_t(loff_t, pos >> stripe_shift, stripes - 1);
+	*last = min_t(loff_t, end >> stripe_shift, stripes - 1);
+}
+
+static bool awcloud_mutex_trylock_stripe(struct awcloud_mutex *dev,
+	unsigned int i, bool write)
+{
+	if (!rwsem) {
+		return mutex_trylock(&dev->mutex[i]);
+	}
+	if (write) {
+		return down_write_trylock(&dev->rwsem[i]);
+	}
+	return down_read_trylock(&dev->rwsem[i]);
+}
+
+static int awcloud_mutex_lock_stripe(struct awcloud_mutex *dev, unsigned int i,
+	bool write)
+{
+	if (!rwsem) {
+		return mutex_lock_interruptible(&dev->mutex[i]) ?
+			-ERESTARTSYS : 0;
+	}
+
+	if (write) {
+		return down_write_killable(&dev->rwsem[i]) ? -ERESTARTSYS : 0;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+	return down_read_interruptible(&dev->rwsem[i]) ? -ERESTARTSYS : 0;
+#else
+	return down_read_killable(&dev->rwsem[i]) ? -ERESTARTSYS : 0;
+#endif
+}
+
+static void awcloud_mutex_unlock_stripe(struct awcloud_mutex *dev,
+	unsigned int i, bool write)
+{
+	if (!rwsem) {
+		mutex_unlock(&dev->mutex[i]);
+	} else if (write) {
+		up_write(&dev->rwsem[i]);
+	} else {
+		up_read(&dev->rwsem[i]);
+	}
+}
+
+static void awcloud_mutex_stat_add(atomic64_t *total, atomic64_t *hist, u64 ns)
+{
+	unsigned int bucket = 0;
+
+	if (ns) {
+		bucket = min_t(unsigned int, ilog2(ns), STAT_BUCKETS - 1);
+	}
+	atomic64_add(ns, total);
+	atomic64_inc(&hist[bucket]);
+}
+
+/*
+ * Every stripe is tried without sleeping first, so an acquisition only
+ * counts as contended, and its wait is only traced, when some stripe was
+ * actually busy. *since is the time the range became held, or 0 when
+ * lock_stats is off.
+ */
+static int awcloud_mutex_lock_range(struct awcloud_mutex *dev, loff_t pos,
+	size_t count, bool write, bool nowait, u64 *since)
+{
+	struct awcloud_mutex_stats *stats = &dev->stats;
+	bool timed = READ_ONCE(lock_stats);
+	bool contended = false;
+	unsigned int first;
+	unsigned int last;
+	unsigned int i;
+	u64 start = 0;
+	int ret;
+
+	if (timed || trace_awcloud_wait_enabled()) {
+		start = ktime_get_ns();
+	}
+
+	awcloud_mutex_stripe_range(pos, count, &first, &last);
+	for (i = first; i <= last; i++) {
+		if (awcloud_mutex_trylock_stripe(dev, i, write)) {
+			continue;
+		}
+		ret = nowait ? -EAGAIN :
+			awcloud_mutex_lock_stripe(dev, i, write);
+		if (ret) {
+			trace_awcloud_wait(dev->minor, write, start, ret);
+			while (i-- > first) {
+				awcloud_mutex_unlock_stripe(dev, i, write);
+			}
+			return ret;
+		}
+		contended = true;
+	}
+
+	if (contended) {
+		trace_awcloud_wait(dev->minor, write, start, 0);
+	}
+
+	*since = 0;
+	if (timed) {
+		*since = ktime_get_ns();
+		atomic64_inc(&stats->acquisitions);
+		if (contended) {
+			atomic64_inc(&stats->contended);
+		}
+		awcloud_mutex_stat_add(&stats->wait_ns, stats->wait_hist,
+			*since - start);
+	}
+
+	return 0;
+}
+
+static void awcloud_mutex_unlock_range(struct awcloud_mutex *dev, loff_t pos,
+	size_t count, bool write, u64 since)
+{
+	struct awcloud_mutex_stats *stats = &dev->stats;
+	unsigned int first;
+	unsigned int last;
+	unsigned int i;
+
+	if (since) {
+		awcloud_mutex_stat_add(&stats->hold_ns, stats->hold_hist,
+			ktime_get_ns() - since);
+	}
+
+	awcloud_mutex_stripe_range(pos, count, &first, &last);
+	for (i = last + 1; i-- > first; ) {
+		awcloud_mutex_unlock_stripe(dev, i, write);
+	}
+}
+
+static int awcloud_mutex_lock_read(struct awcloud_mutex *dev, loff_t pos,
+	size_t count, bool nowait, u64 *since)
+{
+	return awcloud_mutex_lock_range(dev, pos, count, false, nowait, since);
+}
+
+static void awcloud_mutex_unlock_read(struct awcloud_mutex *dev, loff_t pos,
+	size_t count, u64 since)
+{
+	awcloud_mutex_unlock_range(dev, pos, count, false, since);
+}
+
+static int awcloud_mutex_lock_write(struct awcloud_mutex *dev, loff_t pos,
+	size_t count, bool nowait, u64 *since)
+{
+	return awcloud_mutex_lock_range(dev, pos, count, true, nowait, since);
+}
+
+static void awcloud_mutex_unlock_write(struct awcloud_mutex *dev, loff_t pos,
+	size_t count, u64 since)
+{
+	awcloud_mutex_unlock_range(dev, pos, count, true, since);
+}
+
+/* Whole-buffer operations take every stripe */
+static int awcloud_mutex_lock_all(struct awcloud_mutex *dev, bool nowait,
+	u64 *since)
+{
+	return awcloud_mutex_lock_range(dev, 0, BUFFER_LEN, true, nowait,
+		since);
+}
+
+static void awcloud_mutex_unlock_all(struct awcloud_mutex *dev, u64 since)
+{
+	awcloud_mutex_unlock_range(dev, 0, BUFFER_LEN, true, since);
+}
+
+static void awcloud_mutex_stats_reset(struct awcloud_mutex_stats *stats)
+{
+	unsigned int i;
+
+	atomic64_set(&stats->acquisitions, 0);
+	atomic64_set(&stats->contended, 0);
+	atomic64_set(&stats->wait_ns, 0);
+	atomic64_set(&stats->hold_ns, 0);
+	for (i = 0; i < STAT_BUCKETS; i++) {
+		atomic64_set(&stats->wait_hist[i], 0);
+		atomic64_set(&stats->hold_hist[i], 0);
+	}
+}
+
+/* Writers to different stripes may race to move used_len forward */
+static void awcloud_mutex_extend(struct awcloud_mutex *dev, unsigned int end)
+{
+	unsigned int used = READ_ONCE(dev->used_len);
+	unsigned int old;
+
+	while (end > used) {
+		old = cmpxchg(&dev->used_len, used, end);
+		if (old == used) {
+			break;
+		}
+		used = old;
+	}
+}
+
+static struct awcloud_mutex_buf *awcloud_mutex_buf_alloc(unsigned int len,
+	gfp_t gfp)
+{
+	struct awcloud_mutex_buf *buf;
+
+	/*
+	 * MEM_RESIZE lets a version grow to MAX_BUFFER_LEN, too big to ask
+	 * of the slab on every write. kvzalloc() falls back to vmalloc, but
+	 * only for a blocking allocation; a nowait writer stays on kmalloc
+	 * and gets -EAGAIN if that fails.
+	 */
+	if (gfpflags_allow_blocking(gfp)) {
+		buf = kvzalloc(sizeof(*buf) + len, gfp);
+	} else {
+		buf = kzalloc(sizeof(*buf) + len, gfp | __GFP_NOWARN);
+	}
+	if (!buf) {
+		return NULL;
+	}
+	buf->len = len;
+
+	return buf;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0)
+static void awcloud_mutex_buf_free_rcu(struct rcu_head *head)
+{
+	kvfree(container_of(head, struct awcloud_mutex_buf, rcu));
+}
+#endif
+
+static void awcloud_mutex_buf_free(struct awcloud_mutex_buf *buf)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	kvfree_rcu(buf, rcu);
+#else
+	call_rcu(&buf->rcu, awcloud_mutex_buf_free_rcu);
+#endif
+}
+
+/* Callers hold the write side of the lock */
+static struct awcloud_mutex_buf *awcloud_mutex_buf_current(
+	struct awcloud_mutex *dev)
+{
+	return rcu_dereference_protected(dev->buf, true);
+}
+
+/*
+ * Replace the current version with buf. Readers already inside their rcu
+ * section finish on the old one; everyone after this sees the new one.
+ */
+static void awcloud_mutex_buf_publish(struct awcloud_mutex *dev,
+	struct awcloud_mutex_buf *buf)
+{
+	struct awcloud_mutex_buf *old = awcloud_mutex_buf_current(dev);
+
+	rcu_assign_pointer(dev->buf, buf);
+	WRITE_ONCE(dev->size, buf->len);
+	awcloud_mutex_buf_free(old);
+}
+
+static inline struct awcloud_mutex_file *awcloud_mutex_file(
+	struct file *filp)
+{
+	return (struct awcloud_mutex_file *)filp->private_data;
+}
 
 static int open_awcloud_mutex(struct inode *inodep, struct file *filp)
 {
-	filp->private_data = dev;
+	struct awcloud_mutex_file *file;
+
+	file = kmalloc(sizeof(*file) + (rcu ? BUFFER_LEN : 0), GFP_KERNEL);
+	if (!file) {
+		return -ENOMEM;
+	}
+	file->dev = dev;
+	file->busy = 0;
+
+#ifdef FMODE_NOWAIT
+	filp->f_mode |= FMODE_NOWAIT;
+#endif
+	filp->private_data = file;
 	return 0;
 }
 
 static int release_awcloud_mutex(struct inode *inodep, struct file *filp)
 {
+	kfree(awcloud_mutex_file(filp));
 	return 0;
 }
 
-static ssize_t read_awcloud_mutex(struct file *filp,
-	char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t awcloud_mutex_read(struct kiocb *iocb, struct iov_iter *to)
 {
-	int ret = 0;
-	struct awcloud_mutex *dev = (struct awcloud_mutex *)filp->private_data;
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(to);
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_mutex *dev = awcloud_mutex_file(iocb->ki_filp)->dev;
+	u64 since;
 
-	if (*ppos >= BUFFER_LEN) {
+	if (pos >= BUFFER_LEN) {
 		return count ? -ENXIO:0;
 	}
 
-	if (count > (BUFFER_LEN - *ppos)) {
-		count = BUFFER_LEN - *ppos;
+	if (count > (BUFFER_LEN - pos)) {
+		count = BUFFER_LEN - pos;
 	}
 
-	if (mutex_lock_interruptible(&dev->mutex)) {
-		return -ERESTARTSYS;
+	ret = awcloud_mutex_lock_read(dev, pos, count,
+		iocb->ki_flags & IOCB_NOWAIT, &since);
+	if (ret) {
+		return ret;
 	}
 
-	if (copy_to_user(user_buffer, (void *)(dev->buffer + *ppos), count)) {
-		return -EFAULT;
+	ret = copy_to_iter(dev->buffer + pos, count, to);
+	if (!ret && count) {
+		ret = -EFAULT;
+	} else {
+		iocb->ki_pos = pos + ret;
 	}
 
-	*ppos += count;
-	ret = count;
+	awcloud_mutex_unlock_read(dev, pos, count, since);
 
-	mutex_unlock(&dev->mutex);
+	return ret;
+}
+
+static ssize_t awcloud_mutex_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(from);
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_mutex *dev = awcloud_mutex_file(iocb->ki_filp)->dev;
+	u64 since;
+
+	if (pos >= BUFFER_LEN) {
+		return count ? -ENXIO:0;
+	}
+
+	if (count > BUFFER_LEN - pos) {
+		count = BUFFER_LEN - pos;
+	}
+
+	awcloud_dbg("io", "write %zu bytes at %lld\n", count, pos);
+
+	ret = awcloud_mutex_lock_write(dev, pos, count,
+		iocb->ki_flags & IOCB_NOWAIT, &since);
+	if (ret) {
+		return ret;
+	}
+
+	ret = copy_from_iter(dev->buffer + pos, count, from);
+	if (!ret && count) {
+		ret = -EFAULT;
+	} else {
+		iocb->ki_pos = pos + ret;
+		awcloud_mutex_extend(dev, iocb->ki_pos);
+	}
+
+	awcloud_mutex_unlock_write(dev, pos, count, since);
 
 	return ret;
 }
 
-static ssize_t write_awcloud_mutex(struct file *filp,
-	const char __user *user_buffer, size_t count, loff_t *ppos)
+/*
+ * In seqlock mode readers take no lock at all: they copy a snapshot of
+ * the buffer and retry if a writer raced them, so a read never dirties a
+ * shared cache line. Writers still serialize on the lock and only touch
+ * the buffer inside a preempt-disabled write section, which is why the
+ * user data is staged in a bounce buffer before the section is entered.
+ */
+static ssize_t awcloud_mutex_read_seq(struct kiocb *iocb, struct iov_iter *to)
 {
-	int ret = 0;
-	struct awcloud_mutex *dev = (struct awcloud_mutex *)filp->private_data;
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(to);
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_mutex *dev = awcloud_mutex_file(iocb->ki_filp)->dev;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	char stack[SEQ_STACK_LEN];
+	char *snapshot = stack;
+	unsigned int seq;
 
-	if (*ppos >= BUFFER_LEN) {
+	if (pos >= BUFFER_LEN) {
 		return count ? -ENXIO:0;
 	}
 
-	if (count > BUFFER_LEN - *ppos) {
-		count = BUFFER_LEN - *ppos;
+	if (count > (BUFFER_LEN - pos)) {
+		count = BUFFER_LEN - pos;
 	}
 
-	pr_info(
-#if defined(__arm__)
-		"Calling the write function with count %d, and ppos %lld\n",
-#else
-		"Calling the write function with count %ld, and ppos %lld\n",
-#endif
-		count, *ppos);
+	if (count > SEQ_STACK_LEN) {
+		snapshot = kmalloc(count, nowait ? GFP_NOWAIT : GFP_KERNEL);
+		if (!snapshot) {
+			return nowait ? -EAGAIN : -ENOMEM;
+		}
+	}
 
-	if (mutex_lock_interruptible(&dev->mutex)) {
-		return -ERESTARTSYS;
+	do {
+		seq = read_seqcount_begin(&dev->seq);
+		memcpy(snapshot, dev->buffer + pos, count);
+	} while (read_seqcount_retry(&dev->seq, seq));
+
+	ret = copy_to_iter(snapshot, count, to);
+	if (!ret && count) {
+		ret = -EFAULT;
+	} else {
+		iocb->ki_pos = pos + ret;
+	}
+
+	if (snapshot != stack) {
+		kfree(snapshot);
 	}
 
-	if (copy_from_user(dev->buffer + *ppos, user_buffer, count)) {
+	return ret;
+}
+
+static ssize_t awcloud_mutex_write_seq(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(from);
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_mutex *dev = awcloud_mutex_file(iocb->ki_filp)->dev;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	char *bounce;
+	u64 since;
+
+	if (pos >= BUFFER_LEN) {
+		return count ? -ENXIO:0;
+	}
+
+	if (count > BUFFER_LEN - pos) {
+		count = BUFFER_LEN - pos;
+	}
+
+	if (!count) {
+		return 0;
+	}
+
+	bounce = kmalloc(count, nowait ? GFP_NOWAIT : GFP_KERNEL);
+	if (!bounce) {
+		return nowait ? -EAGAIN : -ENOMEM;
+	}
+
+	count = copy_from_iter(bounce, count, from);
+	if (!count) {
 		ret = -EFAULT;
-		return ret;
+		goto copy_from_user_err;
 	}
 
-	*ppos += count;
-	if (*ppos > dev->used_len) {
-		dev->used_len = *ppos;
+	ret = awcloud_mutex_lock_all(dev, nowait, &since);
+	if (ret) {
+		goto copy_from_user_err;
 	}
+
+	preempt_disable();
+	write_seqcount_begin(&dev->seq);
+	memcpy(dev->buffer + pos, bounce, count);
+	write_seqcount_end(&dev->seq);
+	preempt_enable();
+
+	iocb->ki_pos = pos + count;
+	awcloud_mutex_extend(dev, iocb->ki_pos);
 	ret = count;
 
-	mutex_unlock(&dev->mutex);
-	pr_info(
-#if defined(__arm__)
-		"Release the mutex of write for count %d\n",
-#else
-		"Release the mutex of write for count %ld\n",
-#endif
-		count);
+	awcloud_mutex_unlock_all(dev, since);
 
+copy_from_user_err:
+	kfree(bounce);
 	return ret;
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
-int ioctl_awcloud_mutex(struct inode *inodep,
-	struct file *filp, unsigned int cmd, unsigned long arg)
+/*
+ * In rcu mode a reader never waits for a writer, MEM_CLEAR or MEM_RESIZE,
+ * and never writes to shared memory either: it snapshots whatever version
+ * is current into its file's bounce buffer inside an rcu read-side section
+ * and copies out from there. A read returns at most BUFFER_LEN bytes, all
+ * from one version. Writers copy the current version, modify the copy and
+ * publish it.
+ */
+static ssize_t awcloud_mutex_read_rcu(struct kiocb *iocb, struct iov_iter *to)
 {
-#else
-static long ioctl_awcloud_mutex(struct file *filp,
-	unsigned int cmd, unsigned long arg)
+	ssize_t ret = 0;
+	size_t count = min_t(size_t, iov_iter_count(to), BUFFER_LEN);
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_mutex_file *file = awcloud_mutex_file(iocb->ki_filp);
+	struct awcloud_mutex *dev = file->dev;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	struct awcloud_mutex_buf *buf;
+	char *snapshot = file->bounce;
+
+	if (test_and_set_bit_lock(0, &file->busy)) {
+		snapshot = kmalloc(BUFFER_LEN,
+			nowait ? GFP_NOWAIT : GFP_KERNEL);
+		if (!snapshot) {
+			return nowait ? -EAGAIN : -ENOMEM;
+		}
+	}
+
+	rcu_read_lock();
+	buf = rcu_dereference(dev->buf);
+	if (pos >= buf->len) {
+		rcu_read_unlock();
+		ret = count ? -ENXIO:0;
+		goto out;
+	}
+
+	if (count > (buf->len - pos)) {
+		count = buf->len - pos;
+	}
+	memcpy(snapshot, buf->data + pos, count);
+	rcu_read_unlock();
+
+	ret = copy_to_iter(snapshot, count, to);
+	if (!ret && count) {
+		ret = -EFAULT;
+	} else {
+		iocb->ki_pos = pos + ret;
+	}
+
+out:
+	if (snapshot == file->bounce) {
+		clear_bit_unlock(0, &file->busy);
+	} else {
+		kfree(snapshot);
+	}
+	return ret;
+}
+
+static ssize_t awcloud_mutex_write_rcu(struct kiocb *iocb,
+	struct iov_iter *from)
 {
-	//struct inode *inodep = file_inode(filp);
-#endif
-	struct awcloud_mutex *dev = (struct awcloud_mutex *)filp->private_data;
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(from);
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_mutex *dev = awcloud_mutex_file(iocb->ki_filp)->dev;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	struct awcloud_mutex_buf *old;
+	struct awcloud_mutex_buf *buf;
+	u64 since;
+
+	ret = awcloud_mutex_lock_all(dev, nowait, &since);
+	if (ret) {
+		return ret;
+	}
+
+	old = awcloud_mutex_buf_current(dev);
+	if (pos >= old->len) {
+		ret = count ? -ENXIO:0;
+		goto unlock;
+	}
+
+	if (count > old->len - pos) {
+		count = old->len - pos;
+	}
+
+	buf = awcloud_mutex_buf_alloc(old->len,
+		nowait ? GFP_NOWAIT : GFP_KERNEL);
+	if (!buf) {
+		ret = nowait ? -EAGAIN : -ENOMEM;
+		goto unlock;
+	}
+	memcpy(buf->data, old->data, old->len);
+
+	ret = copy_from_iter(buf->data + pos, count, from);
+	if (!ret && count) {
+		kvfree(buf);
+		ret = -EFAULT;
+		goto unlock;
+	}
+
+	awcloud_mutex_buf_publish(dev, buf);
+	iocb->ki_pos = pos + ret;
+	awcloud_mutex_extend(dev, iocb->ki_pos);
+
+unlock:
+	awcloud_mutex_unlock_all(dev, since);
+	return ret;
+}
+
+static long awcloud_mutex_ioctl(struct file *filp, unsigned int cmd,
+	unsigned long arg)
+{
+	struct awcloud_mutex *dev = awcloud_mutex_file(filp)->dev;
+	struct awcloud_mutex_buf *old;
+	struct awcloud_mutex_buf *buf;
+	u64 since;
 
 	switch (cmd) {
 	case MEM_CLEAR:
-		if (mutex_lock_interruptible(&dev->mutex)) {
+		if (awcloud_mutex_lock_all(dev, false, &since)) {
 			return -ERESTARTSYS;
 		}
 
+		if (rcu) {
+			buf = awcloud_mutex_buf_alloc(dev->size, GFP_KERNEL);
+			if (!buf) {
+				awcloud_mutex_unlock_all(dev, since);
+				return -ENOMEM;
+			}
+			awcloud_mutex_buf_publish(dev, buf);
+			dev->used_len = 0;
+			awcloud_mutex_unlock_all(dev, since);
+			awcloud_dbg("ioctl", "buffer cleared\n");
+			break;
+		}
+
+		preempt_disable();
+		write_seqcount_begin(&dev->seq);
 		memset(dev->buffer, 0, BUFFER_LEN);
+		write_seqcount_end(&dev->seq);
+		preempt_enable();
 		dev->used_len = 0;
 
-		mutex_unlock(&dev->mutex);
+		awcloud_mutex_unlock_all(dev, since);
 
-		pr_info("Set Kernel Buffer to Zero\n");
+		awcloud_dbg("ioctl", "buffer cleared\n");
+		break;
+	case MEM_RESIZE:
+		if (!rcu) {
+			return -EPERM;
+		}
+		if (!arg || arg > MAX_BUFFER_LEN) {
+			return -EINVAL;
+		}
+
+		buf = awcloud_mutex_buf_alloc(arg, GFP_KERNEL);
+		if (!buf) {
+			return -ENOMEM;
+		}
+
+		if (awcloud_mutex_lock_all(dev, false, &since)) {
+			kvfree(buf);
+			return -ERESTARTSYS;
+		}
+
+		old = awcloud_mutex_buf_current(dev);
+		memcpy(buf->data, old->data, min(buf->len, old->len));
+		awcloud_mutex_buf_publish(dev, buf);
+		if (dev->used_len > buf->len) {
+			dev->used_len = buf->len;
+		}
+
+		awcloud_mutex_unlock_all(dev, since);
+		break;
+	case LOCK_STATS_RESET:
+		awcloud_mutex_stats_reset(&dev->stats);
 		break;
 	default:
 		return -EINVAL;
@@ -152,22 +787,34 @@ static long ioctl_awcloud_mutex(struct file *filp,
 	return 0;
 }
 
+static long ioctl_awcloud_mutex(struct file *filp,
+	unsigned int cmd, unsigned long arg)
+{
+	unsigned int minor = iminor(file_inode(filp));
+	long ret;
+
+	trace_awcloud_ioctl_enter(minor, cmd, arg);
+	ret = awcloud_mutex_ioctl(filp, cmd, arg);
+	trace_awcloud_ioctl_exit(minor, cmd, ret);
+
+	return ret;
+}
+
 static loff_t llseek_awcloud_mutex(struct file *filp,
 	loff_t offset, int whence)
 {
 	loff_t ret = 0;
-	struct awcloud_mutex *dev = (struct awcloud_mutex *)filp->private_data;
+	struct awcloud_mutex *dev = awcloud_mutex_file(filp)->dev;
+	unsigned int size = READ_ONCE(dev->size);
 
-	pr_info(
-		"Calling the llseek function of this device,"
-		"and offset is %lld , whence is %d\n", offset, whence);
+	awcloud_dbg("seek", "offset %lld whence %d\n", offset, whence);
 	switch (whence) {
 	case SEEK_SET:
 		if (offset < 0) {
 			ret = -EINVAL;
 			break;
 		}
-		if ((unsigned int)offset > BUFFER_LEN) {
+		if ((unsigned int)offset > size) {
 			ret = -EINVAL;
 			break;
 		}
@@ -175,7 +822,7 @@ static loff_t llseek_awcloud_mutex(struct file *filp,
 		ret = filp->f_pos;
 		break;
 	case SEEK_CUR:
-		if ((filp->f_pos + offset) > BUFFER_LEN) {
+		if ((filp->f_pos + offset) > size) {
 			ret = -EINVAL;
 			break;
 		}
@@ -187,7 +834,7 @@ static loff_t llseek_awcloud_mutex(struct file *filp,
 		ret = filp->f_pos;
 		break;
 	case SEEK_END:
-		if ((filp->f_pos + offset) > BUFFER_LEN) {
+		if ((filp->f_pos + offset) > size) {
 			ret = -EINVAL;
 			break;
 		}
@@ -195,7 +842,7 @@ static loff_t llseek_awcloud_mutex(struct file *filp,
 			ret = -EINVAL;
 			break;
 		}
-		if ((dev->used_len+offset) > BUFFER_LEN) {
+		if ((dev->used_len+offset) > size) {
 			ret = -EINVAL;
 			break;
 		}
@@ -210,24 +857,147 @@ static loff_t llseek_awcloud_mutex(struct file *filp,
 	return ret;
 }
 
+static int awcloud_mutex_stats_show(struct seq_file *m, void *v)
+{
+	struct awcloud_mutex_stats *stats = m->private;
+	unsigned int i;
+
+	seq_printf(m, "acquisitions %lld\n",
+		(long long)atomic64_read(&stats->acquisitions));
+	seq_printf(m, "contended %lld\n",
+		(long long)atomic64_read(&stats->contended));
+	seq_printf(m, "wait_ns %lld\n",
+		(long long)atomic64_read(&stats->wait_ns));
+	seq_printf(m, "hold_ns %lld\n",
+		(long long)atomic64_read(&stats->hold_ns));
+	for (i = 0; i < STAT_BUCKETS; i++) {
+		seq_printf(m, "wait_hist %u %lld\n", i,
+			(long long)atomic64_read(&stats->wait_hist[i]));
+	}
+	for (i = 0; i < STAT_BUCKETS; i++) {
+		seq_printf(m, "hold_hist %u %lld\n", i,
+			(long long)atomic64_read(&stats->hold_hist[i]));
+	}
+
+	return 0;
+}
+
+static int awcloud_mutex_stats_open(struct inode *inodep, struct file *filp)
+{
+	return single_open(filp, awcloud_mutex_stats_show, inodep->i_private);
+}
+
+static const struct file_operations awcloud_mutex_stats_fops = {
+	.owner          = THIS_MODULE,
+	.open           = awcloud_mutex_stats_open,
+	.read           = seq_read,
+	.llseek         = seq_lseek,
+	.release        = single_release,
+};
+
+/*
+ * The read_iter and write_iter of every mode wrap the mode's handler in
+ * the entry and exit tracepoints. io is a constant at each call site, so
+ * this inlines down to a direct call.
+ */
+static __always_inline ssize_t awcloud_mutex_traced_io(struct kiocb *iocb,
+	struct iov_iter *iter, bool write,
+	ssize_t (*io)(struct kiocb *, struct iov_iter *))
+{
+	struct awcloud_mutex *dev = awcloud_mutex_file(iocb->ki_filp)->dev;
+	unsigned int minor = iminor(file_inode(iocb->ki_filp));
+	size_t count = iov_iter_count(iter);
+	ssize_t ret;
+
+	if (write) {
+		trace_awcloud_write_enter(minor, count, iocb->ki_pos);
+	} else {
+		trace_awcloud_read_enter(minor, count, iocb->ki_pos);
+	}
+	ret = io(iocb, iter);
+	if (write) {
+		trace_awcloud_write_exit(minor, ret, dev->used_len);
+	} else {
+		trace_awcloud_read_exit(minor, ret, dev->used_len);
+	}
+
+	return ret;
+}
+
+static ssize_t read_iter_awcloud_mutex(struct kiocb *iocb, struct iov_iter *to)
+{
+	return awcloud_mutex_traced_io(iocb, to, false, awcloud_mutex_read);
+}
+
+static ssize_t write_iter_awcloud_mutex(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	return awcloud_mutex_traced_io(iocb, from, true, awcloud_mutex_write);
+}
+
+static ssize_t read_iter_awcloud_mutex_seq(struct kiocb *iocb,
+	struct iov_iter *to)
+{
+	return awcloud_mutex_traced_io(iocb, to, false, awcloud_mutex_read_seq);
+}
+
+static ssize_t write_iter_awcloud_mutex_seq(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	return awcloud_mutex_traced_io(iocb, from, true,
+		awcloud_mutex_write_seq);
+}
+
+static ssize_t read_iter_awcloud_mutex_rcu(struct kiocb *iocb,
+	struct iov_iter *to)
+{
+	return awcloud_mutex_traced_io(iocb, to, false, awcloud_mutex_read_rcu);
+}
+
+static ssize_t write_iter_awcloud_mutex_rcu(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	return awcloud_mutex_traced_io(iocb, from, true,
+		awcloud_mutex_write_rcu);
+}
+
 static const struct file_operations awcloud_mutex_fops = {
-	.owner   = THIS_MODULE,
-	.open    = open_awcloud_mutex,
-	.release = release_awcloud_mutex,
-	.read    = read_awcloud_mutex,
-	.write   = write_awcloud_mutex,
-	.llseek  = llseek_awcloud_mutex,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 0)
-	.ioctl   = ioctl_awcloud_mutex,
-#else
-	.compat_ioctl = ioctl_awcloud_mutex,
+	.owner          = THIS_MODULE,
+	.open           = open_awcloud_mutex,
+	.release        = release_awcloud_mutex,
+	.read_iter      = read_iter_awcloud_mutex,
+	.write_iter     = write_iter_awcloud_mutex,
+	.llseek         = llseek_awcloud_mutex,
+	.compat_ioctl   = ioctl_awcloud_mutex,
+	.unlocked_ioctl = ioctl_awcloud_mutex,
+};
+
+static const struct file_operations awcloud_mutex_seq_fops = {
+	.owner          = THIS_MODULE,
+	.open           = open_awcloud_mutex,
+	.release        = release_awcloud_mutex,
+	.read_iter      = read_iter_awcloud_mutex_seq,
+	.write_iter     = write_iter_awcloud_mutex_seq,
+	.llseek         = llseek_awcloud_mutex,
+	.compat_ioctl   = ioctl_awcloud_mutex,
+	.unlocked_ioctl = ioctl_awcloud_mutex,
+};
+
+static const struct file_operations awcloud_mutex_rcu_fops = {
+	.owner          = THIS_MODULE,
+	.open           = open_awcloud_mutex,
+	.release        = release_awcloud_mutex,
+	.read_iter      = read_iter_awcloud_mutex_rcu,
+	.write_iter     = write_iter_awcloud_mutex_rcu,
+	.llseek         = llseek_awcloud_mutex,
+	.compat_ioctl   = ioctl_awcloud_mutex,
 	.unlocked_ioctl = ioctl_awcloud_mutex,
-#endif
 };
 
 static int awcloud_mutex_setup_chrdev(struct awcloud_mutex *dev)
 {
 	int result = 0;
+	unsigned int i;
 
 	if (major > 0) {
 		dev->dev_id = MKDEV(major, 0);
@@ -253,7 +1023,13 @@ static int awcloud_mutex_setup_chrdev(struct awcloud_mutex *dev)
 
 	dev->cdev->owner = THIS_MODULE;
 
-	cdev_init(dev->cdev, &awcloud_mutex_fops);
+	if (seqlock) {
+		cdev_init(dev->cdev, &awcloud_mutex_seq_fops);
+	} else if (rcu) {
+		cdev_init(dev->cdev, &awcloud_mutex_rcu_fops);
+	} else {
+		cdev_init(dev->cdev, &awcloud_mutex_fops);
+	}
 
 	result = cdev_add(dev->cdev, dev->dev_id, 1);
 	if (result) {
@@ -275,10 +1051,16 @@ static int awcloud_mutex_setup_chrdev(struct awcloud_mutex *dev)
 		goto device_create_err;
 	}
 
-	memset(dev->buffer, 0, BUFFER_LEN);
 	dev->used_len = 0;
 
-	mutex_init(&dev->mutex);
+	for (i = 0; i < MAX_STRIPES; i++) {
+		mutex_init(&dev->mutex[i]);
+		lockdep_set_class(&dev->mutex[i],
+			&awcloud_mutex_stripe_keys[i]);
+		init_rwsem(&dev->rwsem[i]);
+		lockdep_set_class(&dev->rwsem[i], &awcloud_mutex_rwsem_keys[i]);
+	}
+	seqcount_init(&dev->seq);
 
 	return 0;
 
@@ -297,27 +1079,58 @@ static int __init awcloud_mutex_init(void)
 {
 	int result = 0;
 
-	dev = kzalloc(sizeof(struct awcloud_mutex), GFP_KERNEL);
+	if (!stripes || stripes > MAX_STRIPES || !is_power_of_2(stripes)) {
+		result = -EINVAL;
+		goto finally;
+	}
+	stripe_shift = ilog2(BUFFER_LEN / stripes);
+
+	if (seqlock && rcu) {
+		result = -EINVAL;
+		goto finally;
+	}
+
+	dev = kzalloc(sizeof(struct awcloud_mutex) + (rcu ? 0 : BUFFER_LEN),
+		GFP_KERNEL);
 	if (!dev) {
 		result = -ENOMEM;
 		goto finally;
 	}
+
+	dev->size = BUFFER_LEN;
+	if (rcu) {
+		RCU_INIT_POINTER(dev->buf,
+			awcloud_mutex_buf_alloc(BUFFER_LEN, GFP_KERNEL));
+		if (!rcu_access_pointer(dev->buf)) {
+			kfree(dev);
+			result = -ENOMEM;
+			goto finally;
+		}
+	}
+
 	result = awcloud_mutex_setup_chrdev(dev);
 	if (0 > result) {
+		kvfree(rcu_access_pointer(dev->buf));
 		kfree(dev);
 		goto finally;
 	}
 
+	dev->debugfs = debugfs_create_dir(DEV_NAME, NULL);
+	debugfs_create_file("lock_stats", 0444, dev->debugfs, &dev->stats,
+		&awcloud_mutex_stats_fops);
+
 finally:
 	return result;
 }
 
 static void __exit awcloud_mutex_exit(void)
 {
+	debugfs_remove_recursive(dev->debugfs);
 	device_destroy(dev->class, dev->dev_id);
 	class_destroy(dev->class);
 	cdev_del(dev->cdev);
 	unregister_chrdev_region(dev->dev_id, 1);
+	kvfree(rcu_access_pointer(dev->buf));
 	kfree(dev);
 }
 
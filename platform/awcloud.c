@@ -6,41 +6,107 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/poll.h>
-
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
+#include <linux/ktime.h>
+#include <linux/percpu.h>
 #include <linux/device.h>
-#else
+#include <linux/platform_device.h>
+#include <linux/pm_runtime.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
 #include <linux/sched/signal.h>
 #endif
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+/*
+ * Debug messages, off unless enabled through dynamic debug and rate
+ * limited when on. Each one starts with its category (io, seek, ioctl)
+ * so a category can be switched on by itself, e.g.
+ *   echo 'module awcloud format "io: " +p' > /proc/dynamic_debug/control
+ */
+#define awcloud_dbg(cat, fmt, ...) \
+	pr_debug_ratelimited(cat ": " fmt, ##__VA_ARGS__)
+
 #define DEV_NAME "awcloud"
 #define BUFFER_LEN 4096
 #define MEM_CLEAR 0x1
 
+/*
+ * Per-device counters, one copy per CPU so the I/O path never writes a
+ * cacheline shared with other CPUs. They are only summed up when read
+ * through the stats directory of the device in sysfs.
+ */
+struct awcloud_platform_stats {
+	unsigned long bytes_read;
+	unsigned long bytes_written;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long blocked_reads;
+	unsigned long blocked_writes;
+	unsigned long eagain;
+	unsigned long sigio;
+};
+
+#define awcloud_platform_stat_add(dev, field, n) \
+	this_cpu_add((dev)->stats->field, n)
+#define awcloud_platform_stat_inc(dev, field) \
+	this_cpu_inc((dev)->stats->field)
+
+/*
+ * One instance per platform device, allocated in probe and released by
+ * devm when the device goes away. Unbinding through sysfs is disabled,
+ * so that only happens at module unload, after the last file is closed.
+ *
+ * The buffer only exists while the platform device is runtime active:
+ * every open file holds a runtime PM reference, and once the last one
+ * is closed and the buffer is empty it is freed after the autosuspend
+ * delay, then allocated again by the next open.
+ */
 struct awcloud_platform {
 	unsigned int         used_len;
+	struct device        *parent;
 	struct device        *device;
-	struct class         *class;
 	struct fasync_struct *async_queue;
-	char                 buffer[BUFFER_LEN];
+	struct awcloud_platform_stats __percpu *stats;
+	char                 *buffer;
 	struct semaphore     sem;
 	struct cdev          cdev;
 	wait_queue_head_t    r_wait;
 	wait_queue_head_t    w_wait;
 };
 
-static struct awcloud_platform *dev;
 static unsigned int major;
 static unsigned int num_devices;
+static int autosuspend_delay_ms = 5000;
 module_param(major, uint, 0444);
 module_param(num_devices, uint, 0444);
+module_param(autosuspend_delay_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_delay_ms,
+	"Idle time before an unused buffer is freed, -1 to keep it");
+
+static struct class *awcloud_platform_class;
+static struct platform_device **awcloud_platform_pdevs;
 
 static int open_awcloud_platform(struct inode *inodep, struct file *filp)
 {
 	struct awcloud_platform *dev = container_of(
 		inodep->i_cdev, struct awcloud_platform, cdev);
+	int result;
+
+	/* Brings the buffer back if the device was suspended */
+	result = pm_runtime_get_sync(dev->parent);
+	if (0 > result) {
+		pm_runtime_put_noidle(dev->parent);
+		return result;
+	}
+
 	filp->private_data = dev;
+#ifdef FMODE_NOWAIT
+	filp->f_mode |= FMODE_NOWAIT;
+#endif
 	return 0;
 }
 
@@ -54,33 +120,50 @@ static int fasync_awcloud_platform(int fd, struct file *filp, int on)
 
 static int release_awcloud_platform(struct inode *inodep, struct file *filp)
 {
+	struct awcloud_platform *dev = (struct awcloud_platform *)filp->private_data;
+
 	fasync_awcloud_platform(-1, filp, 0);
+	pm_runtime_mark_last_busy(dev->parent);
+	pm_runtime_put_autosuspend(dev->parent);
 	return 0;
 }
 
-static ssize_t read_awcloud_platform(struct file *filp,
-	char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t awcloud_platform_read(struct kiocb *iocb, struct iov_iter *to)
 {
-	int ret = 0;
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(to);
+	struct file *filp = iocb->ki_filp;
 	struct awcloud_platform *dev = (struct awcloud_platform *)filp->private_data;
-
-	DECLARE_WAITQUEUE(wait, current);
-
-	down(&dev->sem);
-	add_wait_queue(&dev->r_wait, &wait);
-
-	if (0 == dev->used_len) {
-		if (filp->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			goto again_err;
+	unsigned int minor = iminor(file_inode(filp));
+	u64 since;
+	int result;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (down_trylock(&dev->sem)) {
+			awcloud_platform_stat_inc(dev, eagain);
+			return -EAGAIN;
 		}
-		__set_current_state(TASK_INTERRUPTIBLE);
+	} else {
+		down(&dev->sem);
+	}
+	while (0 == dev->used_len) {
 		up(&dev->sem);
-		schedule();
-
-		if (signal_pending(current)) {
-			ret = -ERESTARTSYS;
-			goto out;
+		if ((filp->f_flags & O_NONBLOCK) ||
+			(iocb->ki_flags & IOCB_NOWAIT)) {
+			awcloud_platform_stat_inc(dev, eagain);
+			return -EAGAIN;
+		}
+		/*
+		 * Exclusive wait: one writer wakes one reader instead of the
+		 * whole queue, and the condition is rechecked under the lock.
+		 */
+		awcloud_platform_stat_inc(dev, blocked_reads);
+		since = trace_awcloud_wait_enabled() ? ktime_get_ns() : 0;
+		result = wait_event_interruptible_exclusive(dev->r_wait,
+			dev->used_len);
+		trace_awcloud_wait(minor, false, since, result);
+		if (result) {
+			return -ERESTARTSYS;
 		}
 		down(&dev->sem);
 	}
@@ -89,65 +172,87 @@ static ssize_t read_awcloud_platform(struct file *filp,
 		count = dev->used_len;
 	}
 
-	if (copy_to_user(user_buffer, dev->buffer, count)) {
+	if (copy_to_iter(dev->buffer, count, to) != count) {
 		ret = -EFAULT;
 		goto copy_to_user_err;
 	}
 
 	//memcpy(dev->buffer, dev->buffer+count, dev->used_len-count);
 	dev->used_len -= count;
-#if defined(__arm__)
-	pr_info("Read %d bytes, current lenth is %d\n", count, dev->used_len);
-#else
-	pr_info("Read %ld bytes, current lenth is %d\n", count, dev->used_len);
-#endif
-	wake_up_interruptible(&dev->w_wait);
+	awcloud_dbg("io", "read %zu bytes, %u left\n", count, dev->used_len);
+	trace_awcloud_wakeup(minor, AWCLOUD_WAKE_READ, POLLOUT | POLLWRNORM);
+	wake_up_interruptible_poll(&dev->w_wait, POLLOUT | POLLWRNORM);
+	if (dev->used_len) {
+		/* Hand the wakeup on to the next reader */
+		trace_awcloud_wakeup(minor, AWCLOUD_WAKE_READ,
+			POLLIN | POLLRDNORM);
+		wake_up_interruptible_poll(&dev->r_wait, POLLIN | POLLRDNORM);
+	}
 	if (dev->async_queue) {
 		kill_fasync(&dev->async_queue, SIGIO, POLL_OUT);
-		pr_debug("%s kill SIGIO", __func__);
+		awcloud_platform_stat_inc(dev, sigio);
+		awcloud_dbg("io", "%s kill SIGIO\n", __func__);
 	}
+	awcloud_platform_stat_inc(dev, reads);
+	awcloud_platform_stat_add(dev, bytes_read, count);
 	ret = count;
 
-again_err:
 copy_to_user_err:
 	up(&dev->sem);
 
-out:
-	remove_wait_queue(&dev->r_wait, &wait);
-	set_current_state(TASK_RUNNING);
+	return ret;
+}
+
+static ssize_t read_iter_awcloud_platform(struct kiocb *iocb,
+	struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	struct awcloud_platform *dev =
+		(struct awcloud_platform *)filp->private_data;
+	unsigned int minor = iminor(file_inode(filp));
+	ssize_t ret;
+
+	trace_awcloud_read_enter(minor, iov_iter_count(to), iocb->ki_pos);
+	ret = awcloud_platform_read(iocb, to);
+	trace_awcloud_read_exit(minor, ret, dev->used_len);
 
 	return ret;
 }
 
-static ssize_t write_awcloud_platform(struct file *filp,
-	const char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t awcloud_platform_write(struct kiocb *iocb, struct iov_iter *from)
 {
-	int ret = 0;
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(from);
+	struct file *filp = iocb->ki_filp;
 	struct awcloud_platform *dev = (struct awcloud_platform *)filp->private_data;
-	DECLARE_WAITQUEUE(wait, current);
-
-	pr_info(
-#if defined(__arm__)
-		"Calling the write function with count %d, and ppos %lld\n",
-#else
-		"Calling the write function with count %ld, and ppos %lld\n",
-#endif
-		count, *ppos);
+	unsigned int minor = iminor(file_inode(filp));
+	u64 since;
+	int result;
 
-	down(&dev->sem);
-	add_wait_queue(&dev->w_wait, &wait);
+	awcloud_dbg("io", "write %zu bytes at %lld\n", count, iocb->ki_pos);
 
-	if (BUFFER_LEN == dev->used_len) {
-		if (filp->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			goto again_err;
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (down_trylock(&dev->sem)) {
+			awcloud_platform_stat_inc(dev, eagain);
+			return -EAGAIN;
 		}
-		__set_current_state(TASK_INTERRUPTIBLE);
+	} else {
+		down(&dev->sem);
+	}
+	while (BUFFER_LEN == dev->used_len) {
 		up(&dev->sem);
-		schedule();
-		if (signal_pending(current)) {
-			ret = -ERESTARTSYS;
-			goto out;
+		if ((filp->f_flags & O_NONBLOCK) ||
+			(iocb->ki_flags & IOCB_NOWAIT)) {
+			awcloud_platform_stat_inc(dev, eagain);
+			return -EAGAIN;
+		}
+		awcloud_platform_stat_inc(dev, blocked_writes);
+		since = trace_awcloud_wait_enabled() ? ktime_get_ns() : 0;
+		result = wait_event_interruptible_exclusive(dev->w_wait,
+			BUFFER_LEN != dev->used_len);
+		trace_awcloud_wait(minor, true, since, result);
+		if (result) {
+			return -ERESTARTSYS;
 		}
 		down(&dev->sem);
 	}
@@ -156,44 +261,57 @@ static ssize_t write_awcloud_platform(struct file *filp,
 		count = BUFFER_LEN - dev->used_len;
 	}
 
-	if (copy_from_user(dev->buffer+dev->used_len, user_buffer, count)) {
+	if (copy_from_iter(dev->buffer+dev->used_len, count, from) != count) {
 		ret = -EFAULT;
 		goto copy_from_user_err;
 	}
 
 	dev->used_len += count;
-	wake_up_interruptible(&dev->r_wait);
+	trace_awcloud_wakeup(minor, AWCLOUD_WAKE_WRITE, POLLIN | POLLRDNORM);
+	wake_up_interruptible_poll(&dev->r_wait, POLLIN | POLLRDNORM);
+	if (BUFFER_LEN != dev->used_len) {
+		trace_awcloud_wakeup(minor, AWCLOUD_WAKE_WRITE,
+			POLLOUT | POLLWRNORM);
+		wake_up_interruptible_poll(&dev->w_wait, POLLOUT | POLLWRNORM);
+	}
+	awcloud_platform_stat_inc(dev, writes);
+	awcloud_platform_stat_add(dev, bytes_written, count);
 	ret = count;
 
 	if (dev->async_queue) {
 		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
-		pr_debug("%s kill SIGIO", __func__);
+		awcloud_platform_stat_inc(dev, sigio);
+		awcloud_dbg("io", "%s kill SIGIO\n", __func__);
 	}
 
-again_err:
 copy_from_user_err:
 	up(&dev->sem);
 
-out:
-	remove_wait_queue(&dev->w_wait, &wait);
-	set_current_state(TASK_RUNNING);
-
 	return ret;
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
-int ioctl_awcloud_platform(struct inode *inodep,
-	struct file *filp, unsigned int cmd, unsigned long arg)
+static ssize_t write_iter_awcloud_platform(struct kiocb *iocb,
+	struct iov_iter *from)
 {
-#else
-static long ioctl_awcloud_platform(struct file *filp,
-	unsigned int cmd, unsigned long arg)
+	struct file *filp = iocb->ki_filp;
+	struct awcloud_platform *dev =
+		(struct awcloud_platform *)filp->private_data;
+	unsigned int minor = iminor(file_inode(filp));
+	ssize_t ret;
+
+	trace_awcloud_write_enter(minor, iov_iter_count(from), iocb->ki_pos);
+	ret = awcloud_platform_write(iocb, from);
+	trace_awcloud_write_exit(minor, ret, dev->used_len);
+
+	return ret;
+}
+
+static long awcloud_platform_ioctl(struct file *filp, unsigned int cmd,
+	unsigned long arg)
 {
-	//struct inode *inodep = file_inode(filp);
-#endif
 	struct awcloud_platform *dev = (struct awcloud_platform *)filp->private_data;
 
-	pr_info("Calling the ioctl function\n");
+	awcloud_dbg("ioctl", "cmd 0x%x\n", cmd);
 	switch (cmd) {
 	case MEM_CLEAR:
 		if (down_interruptible(&dev->sem)) {
@@ -205,7 +323,7 @@ static long ioctl_awcloud_platform(struct file *filp,
 
 		up(&dev->sem);
 
-		pr_info("Set Kernel Buffer to Zero\n");
+		awcloud_dbg("ioctl", "buffer cleared\n");
 		break;
 	default:
 		return -EINVAL;
@@ -213,15 +331,26 @@ static long ioctl_awcloud_platform(struct file *filp,
 	return 0;
 }
 
+static long ioctl_awcloud_platform(struct file *filp,
+	unsigned int cmd, unsigned long arg)
+{
+	unsigned int minor = iminor(file_inode(filp));
+	long ret;
+
+	trace_awcloud_ioctl_enter(minor, cmd, arg);
+	ret = awcloud_platform_ioctl(filp, cmd, arg);
+	trace_awcloud_ioctl_exit(minor, cmd, ret);
+
+	return ret;
+}
+
 static loff_t llseek_awcloud_platform(struct file *filp,
 	loff_t offset, int whence)
 {
 	loff_t ret = 0;
 	struct awcloud_platform *dev = (struct awcloud_platform *)filp->private_data;
 
-	pr_info(
-		"Calling the llseek function of this device,"
-		"and offset is %lld , whence is %d\n", offset, whence);
+	awcloud_dbg("seek", "offset %lld whence %d\n", offset, whence);
 	switch (whence) {
 	case SEEK_SET:
 		if (offset < 0) {
@@ -293,6 +422,8 @@ __poll_t poll_awcloud_platform(
 	if (BUFFER_LEN != dev->used_len) {
 		mask |= POLLOUT | POLLWRNORM;
 	}
+	trace_awcloud_poll(iminor(file_inode(filp)),
+		(__force unsigned int)mask, dev->used_len);
 	up(&dev->sem);
 
 	return mask;
@@ -302,77 +433,250 @@ const static struct file_operations awcloud_platform_fops = {
 	.owner          = THIS_MODULE,
 	.open           = open_awcloud_platform,
 	.release        = release_awcloud_platform,
-	.read           = read_awcloud_platform,
-	.write          = write_awcloud_platform,
+	.read_iter      = read_iter_awcloud_platform,
+	.write_iter     = write_iter_awcloud_platform,
 	.llseek         = llseek_awcloud_platform,
 	.poll           = poll_awcloud_platform,
 	.fasync         = fasync_awcloud_platform,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 0)
-	.ioctl          = ioctl_awcloud_platform,
-#else
 	.compat_ioctl   = ioctl_awcloud_platform,
 	.unlocked_ioctl = ioctl_awcloud_platform,
-#endif
 };
 
-static int awcloud_platform_setup_chrdev(struct awcloud_platform *dev, int index)
+static unsigned long awcloud_platform_stat_sum(struct awcloud_platform *dev,
+	size_t offset)
 {
-	int result = 0;
-	char device_name[10];
-	dev_t dev_id = MKDEV(major, index);
+	unsigned long sum = 0;
+	int cpu;
 
-	dev->cdev.owner = THIS_MODULE;
-	cdev_init(&dev->cdev, &awcloud_platform_fops);
-	if (cdev_add(&dev->cdev, dev_id, 1)) {
-		pr_err("Failed to add char dev into system\n");
-		result = -1;
-		goto cdev_add_err;
+	for_each_possible_cpu(cpu) {
+		sum += *(unsigned long *)((char *)per_cpu_ptr(dev->stats, cpu) +
+			offset);
 	}
 
-	sprintf(device_name, DEV_NAME"%d", index);
-	dev->device = device_create(
-		dev->class, NULL, dev_id, NULL, device_name);
-	if (IS_ERR(dev->device)) {
-		result = -1;
-		goto device_create_err;
+	return sum;
+}
+
+#define AWCLOUD_PLATFORM_STAT_ATTR(field)				\
+static ssize_t field##_show(struct device *device,			\
+	struct device_attribute *attr, char *buf)			\
+{									\
+	struct awcloud_platform *dev = dev_get_drvdata(device);		\
+	size_t offset = offsetof(struct awcloud_platform_stats, field);	\
+									\
+	return sprintf(buf, "%lu\n",					\
+		awcloud_platform_stat_sum(dev, offset));		\
+}									\
+static DEVICE_ATTR_RO(field)
+
+AWCLOUD_PLATFORM_STAT_ATTR(bytes_read);
+AWCLOUD_PLATFORM_STAT_ATTR(bytes_written);
+AWCLOUD_PLATFORM_STAT_ATTR(reads);
+AWCLOUD_PLATFORM_STAT_ATTR(writes);
+AWCLOUD_PLATFORM_STAT_ATTR(blocked_reads);
+AWCLOUD_PLATFORM_STAT_ATTR(blocked_writes);
+AWCLOUD_PLATFORM_STAT_ATTR(eagain);
+AWCLOUD_PLATFORM_STAT_ATTR(sigio);
+
+static ssize_t used_len_show(struct device *device,
+	struct device_attribute *attr, char *buf)
+{
+	struct awcloud_platform *dev = dev_get_drvdata(device);
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->used_len));
+}
+static DEVICE_ATTR_RO(used_len);
+
+static struct attribute *awcloud_platform_stats_attrs[] = {
+	&dev_attr_bytes_read.attr,
+	&dev_attr_bytes_written.attr,
+	&dev_attr_reads.attr,
+	&dev_attr_writes.attr,
+	&dev_attr_blocked_reads.attr,
+	&dev_attr_blocked_writes.attr,
+	&dev_attr_eagain.attr,
+	&dev_attr_sigio.attr,
+	&dev_attr_used_len.attr,
+	NULL,
+};
+
+static const struct attribute_group awcloud_platform_stats_group = {
+	.name  = "stats",
+	.attrs = awcloud_platform_stats_attrs,
+};
+
+static const struct attribute_group *awcloud_platform_groups[] = {
+	&awcloud_platform_stats_group,
+	NULL,
+};
+
+static void awcloud_platform_cdev_del(void *data)
+{
+	cdev_del(data);
+}
+
+static void awcloud_platform_device_destroy(void *data)
+{
+	struct awcloud_platform *dev = data;
+
+	device_destroy(awcloud_platform_class, dev->cdev.dev);
+}
+
+/*
+ * Runtime suspend only happens with no file open, so nothing else can
+ * be using the buffer. Queued data is kept: the device stays active
+ * until a reader drains it and closes again.
+ */
+static int awcloud_platform_runtime_suspend(struct device *parent)
+{
+	struct awcloud_platform *dev = dev_get_drvdata(parent);
+
+	if (dev->used_len) {
+		return -EBUSY;
+	}
+
+	kfree(dev->buffer);
+	dev->buffer = NULL;
+	return 0;
+}
+
+static int awcloud_platform_runtime_resume(struct device *parent)
+{
+	struct awcloud_platform *dev = dev_get_drvdata(parent);
+
+	dev->buffer = kzalloc(BUFFER_LEN, GFP_KERNEL);
+	if (!dev->buffer) {
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void awcloud_platform_pm_disable(void *data)
+{
+	struct awcloud_platform *dev = data;
+
+	pm_runtime_disable(dev->parent);
+	pm_runtime_dont_use_autosuspend(dev->parent);
+	pm_runtime_set_suspended(dev->parent);
+	kfree(dev->buffer);
+	dev->buffer = NULL;
+}
+
+static const struct dev_pm_ops awcloud_platform_pm_ops = {
+	SET_RUNTIME_PM_OPS(awcloud_platform_runtime_suspend,
+		awcloud_platform_runtime_resume, NULL)
+};
+
+static int awcloud_platform_probe(struct platform_device *pdev)
+{
+	struct awcloud_platform *dev;
+	dev_t dev_id = MKDEV(major, pdev->id);
+	int result = 0;
+
+	dev = devm_kzalloc(&pdev->dev, sizeof(struct awcloud_platform),
+		GFP_KERNEL);
+	if (!dev) {
+		return -ENOMEM;
 	}
 
-	memset(dev->buffer, 0, BUFFER_LEN);
-	dev->used_len = 0;
+	dev->stats = devm_alloc_percpu(&pdev->dev,
+		struct awcloud_platform_stats);
+	if (!dev->stats) {
+		return -ENOMEM;
+	}
 
 	sema_init(&(dev->sem), 1);
 	init_waitqueue_head(&dev->r_wait);
 	init_waitqueue_head(&dev->w_wait);
-	return result;
+	dev->parent = &pdev->dev;
+	platform_set_drvdata(pdev, dev);
+
+	/*
+	 * Start out active with a reference held, so the buffer is there
+	 * even without CONFIG_PM; dropping the reference at the end of probe
+	 * lets an unused instance suspend.
+	 */
+	result = awcloud_platform_runtime_resume(&pdev->dev);
+	if (result) {
+		return result;
+	}
+	pm_runtime_set_autosuspend_delay(&pdev->dev, autosuspend_delay_ms);
+	pm_runtime_use_autosuspend(&pdev->dev);
+	pm_runtime_get_noresume(&pdev->dev);
+	pm_runtime_set_active(&pdev->dev);
+	pm_runtime_enable(&pdev->dev);
+	result = devm_add_action_or_reset(&pdev->dev,
+		awcloud_platform_pm_disable, dev);
+	if (result) {
+		pm_runtime_put_noidle(&pdev->dev);
+		return result;
+	}
+
+	cdev_init(&dev->cdev, &awcloud_platform_fops);
+	dev->cdev.owner = THIS_MODULE;
+	result = cdev_add(&dev->cdev, dev_id, 1);
+	if (result) {
+		dev_err(&pdev->dev, "Failed to add char dev into system\n");
+		goto probe_err;
+	}
+	result = devm_add_action_or_reset(&pdev->dev,
+		awcloud_platform_cdev_del, &dev->cdev);
+	if (result) {
+		goto probe_err;
+	}
+
+	dev->device = device_create_with_groups(awcloud_platform_class,
+		&pdev->dev, dev_id, dev, awcloud_platform_groups,
+		DEV_NAME"%d", pdev->id);
+	if (IS_ERR(dev->device)) {
+		result = PTR_ERR(dev->device);
+		goto probe_err;
+	}
+	result = devm_add_action_or_reset(&pdev->dev,
+		awcloud_platform_device_destroy, dev);
 
-device_create_err:
-	cdev_del(&dev->cdev);
-cdev_add_err:
+probe_err:
+	pm_runtime_mark_last_busy(&pdev->dev);
+	pm_runtime_put_autosuspend(&pdev->dev);
 	return result;
 }
 
-static void release_awcloud_platform_chrdev(struct awcloud_platform *dev, int index)
-{
-	dev_t dev_id = MKDEV(major, index);
+/*
+ * Everything probe sets up is devm managed, so there is no remove
+ * callback. Probing runs asynchronously: module init only registers the
+ * devices and each instance comes up, or fails, on its own.
+ */
+static struct platform_driver awcloud_platform_driver = {
+	.probe = awcloud_platform_probe,
+	.driver = {
+		.name                = DEV_NAME,
+		.pm                  = &awcloud_platform_pm_ops,
+		.suppress_bind_attrs = true,
+		.probe_type          = PROBE_PREFER_ASYNCHRONOUS,
+	},
+};
 
-	device_destroy(dev->class, dev_id);
-	cdev_del(&dev->cdev);
+static void awcloud_platform_unregister_devices(unsigned int count)
+{
+	while (count--) {
+		platform_device_unregister(awcloud_platform_pdevs[count]);
+	}
 }
 
 static int __init awcloud_platform_init(void)
 {
 	int result = 0;
-	int index = 0;
-	int tmp[3] = {0};
+	unsigned int index = 0;
 	dev_t dev_id;
-	struct class *class = NULL;
+	struct platform_device *pdev;
 
 	if (0 >= num_devices) {
 		num_devices = 1;
 	}
 
-	dev = kzalloc(sizeof(struct awcloud_platform) * num_devices, GFP_KERNEL);
-	if (!dev) {
+	awcloud_platform_pdevs = kcalloc(num_devices,
+		sizeof(struct platform_device *), GFP_KERNEL);
+	if (!awcloud_platform_pdevs) {
 		result = -ENOMEM;
 		goto finally;
 	}
@@ -388,55 +692,57 @@ static int __init awcloud_platform_init(void)
 
 	if (result) {
 		pr_err("Failed to alloc the char dev number\n");
-		result = -EFAULT;
 		goto alloc_dev_id_err;
 	}
 
 	major = MAJOR(dev_id);
-	class = class_create(THIS_MODULE, DEV_NAME);
-	if (IS_ERR(class)) {
-		result = -1;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0)
+	awcloud_platform_class = class_create(THIS_MODULE, DEV_NAME);
+#else
+	awcloud_platform_class = class_create(DEV_NAME);
+#endif
+	if (IS_ERR(awcloud_platform_class)) {
+		result = PTR_ERR(awcloud_platform_class);
 		goto class_create_err;
 	}
 
-	for (index = 0; index < num_devices; index++) {
-		(dev+index)->class = class;
-		tmp[index] = awcloud_platform_setup_chrdev(dev+index, index);
-		result |= tmp[index];
+	result = platform_driver_register(&awcloud_platform_driver);
+	if (result) {
+		goto driver_register_err;
 	}
 
-	if (result) {
-		for (index = 0; index < num_devices; index++) {
-			if (!tmp[index]) {
-				release_awcloud_platform_chrdev(dev+index, index);
-			}
+	for (index = 0; index < num_devices; index++) {
+		pdev = platform_device_register_simple(DEV_NAME, index,
+			NULL, 0);
+		if (IS_ERR(pdev)) {
+			result = PTR_ERR(pdev);
+			goto device_register_err;
 		}
-		goto setup_chrdev_err;
+		awcloud_platform_pdevs[index] = pdev;
 	}
 
-	return result;
+	return 0;
 
-setup_chrdev_err:
-	class_destroy(class);
+device_register_err:
+	awcloud_platform_unregister_devices(index);
+	platform_driver_unregister(&awcloud_platform_driver);
+driver_register_err:
+	class_destroy(awcloud_platform_class);
 class_create_err:
 	unregister_chrdev_region(MKDEV(major, 0), num_devices);
 alloc_dev_id_err:
-	kfree(dev);
+	kfree(awcloud_platform_pdevs);
 finally:
 	return result;
 }
 
 static void __exit awcloud_platform_exit(void)
 {
-	int index = 0;
-
-	for (index = 0; index < num_devices; index++) {
-		release_awcloud_platform_chrdev(dev+index, index);
-	}
-
-	class_destroy(dev->class);
+	awcloud_platform_unregister_devices(num_devices);
+	platform_driver_unregister(&awcloud_platform_driver);
+	class_destroy(awcloud_platform_class);
 	unregister_chrdev_region(MKDEV(major, 0), num_devices);
-	kfree(dev);
+	kfree(awcloud_platform_pdevs);
 }
 
 module_init(awcloud_platform_init);
@@ -5,21 +5,66 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/compat.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/timer.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
 #include <linux/device.h>
+#else
+#include <linux/sched/signal.h>
 #endif
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+/*
+ * Debug messages, off unless enabled through dynamic debug and rate
+ * limited when on. Each one starts with its category (io, seek, ioctl, timer)
+ * so a category can be switched on by itself, e.g.
+ *   echo 'module awcloud format "io: " +p' > /proc/dynamic_debug/control
+ */
+#define awcloud_dbg(cat, fmt, ...) \
+	pr_debug_ratelimited(cat ": " fmt, ##__VA_ARGS__)
+
 #define DEV_NAME "awcloud"
 #define MEM_CLEAR 0x1
+#define SECONDS_SET_PERIOD 0x2
+#define SECONDS_GET_OVERRUN 0x3
+
+#define MIN_PERIOD_NS (10 * NSEC_PER_USEC)
 
 struct awcloud_seconds {
 	struct device        *device;
 	struct class         *class;
 	struct cdev          cdev;
+};
+
+/*
+ * Every open file has its own ticker. With period_ns at 0 it is the
+ * jiffies timer counting whole seconds; SECONDS_SET_PERIOD switches it to
+ * an hrtimer with the given period. The hrtimer is moved forward from
+ * its own expiry rather than from now, so it does not drift, and ticks
+ * it could not deliver in time are added to overrun.
+ *
+ * counter holds the ticks since the last read. A read takes them all
+ * and sleeps on wait while there are none, like a timerfd.
+ */
+struct awcloud_seconds_ctx {
+	unsigned int         minor;
 	atomic_t             counter;
+	atomic_t             overrun;
+	struct mutex         lock;
+	wait_queue_head_t    wait;
+	u64                  period_ns;
 	struct timer_list    timer;
+	struct hrtimer       hrtimer;
 };
 
 static struct awcloud_seconds *dev;
@@ -28,57 +73,263 @@ static unsigned int num_devices;
 module_param(major, uint, 0444);
 module_param(num_devices, uint, 0444);
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
 static void awcloud_seconds_handler(unsigned long arg)
 {
-	mod_timer(&dev->timer, jiffies + HZ);
-	atomic_inc(&dev->counter);
-	pr_info("Current jiffies is %ld\n", jiffies);
+	struct awcloud_seconds_ctx *ctx = (struct awcloud_seconds_ctx *)arg;
+#else
+static void awcloud_seconds_handler(struct timer_list *timer)
+{
+	struct awcloud_seconds_ctx *ctx =
+		container_of(timer, struct awcloud_seconds_ctx, timer);
+#endif
+
+	mod_timer(&ctx->timer, jiffies + HZ);
+	atomic_inc(&ctx->counter);
+	awcloud_dbg("timer", "jiffies %lu\n", jiffies);
+	trace_awcloud_wakeup(ctx->minor, AWCLOUD_WAKE_TIMER,
+		POLLIN | POLLRDNORM);
+	wake_up_interruptible_poll(&ctx->wait, POLLIN | POLLRDNORM);
+}
+
+static enum hrtimer_restart awcloud_seconds_hrtimer_handler(
+	struct hrtimer *hrtimer)
+{
+	struct awcloud_seconds_ctx *ctx =
+		container_of(hrtimer, struct awcloud_seconds_ctx, hrtimer);
+	u64 ticks;
+
+	ticks = hrtimer_forward_now(hrtimer, ns_to_ktime(ctx->period_ns));
+	atomic_add(ticks, &ctx->counter);
+	if (1 < ticks) {
+		atomic_add(ticks - 1, &ctx->overrun);
+		awcloud_dbg("timer", "%llu periods missed\n", ticks - 1);
+	}
+	trace_awcloud_wakeup(ctx->minor, AWCLOUD_WAKE_TIMER,
+		POLLIN | POLLRDNORM);
+	wake_up_interruptible_poll(&ctx->wait, POLLIN | POLLRDNORM);
+
+	return HRTIMER_RESTART;
+}
+
+static void awcloud_seconds_start(struct awcloud_seconds_ctx *ctx)
+{
+	if (ctx->period_ns) {
+		hrtimer_start(&ctx->hrtimer, ns_to_ktime(ctx->period_ns),
+			HRTIMER_MODE_REL);
+	} else {
+		mod_timer(&ctx->timer, jiffies + HZ);
+	}
+}
+
+static void awcloud_seconds_stop(struct awcloud_seconds_ctx *ctx)
+{
+	if (ctx->period_ns) {
+		hrtimer_cancel(&ctx->hrtimer);
+	} else {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 2, 0)
+		del_timer_sync(&ctx->timer);
+#else
+		timer_delete_sync(&ctx->timer);
+#endif
+	}
 }
 
 static int open_awcloud_seconds(struct inode *inodep, struct file *filp)
 {
-	struct awcloud_seconds *dev = container_of(
-		inodep->i_cdev, struct awcloud_seconds, cdev);
+	struct awcloud_seconds_ctx *ctx;
+
+	ctx = kzalloc(sizeof(struct awcloud_seconds_ctx), GFP_KERNEL);
+	if (!ctx) {
+		return -ENOMEM;
+	}
 
-	filp->private_data = dev;
-	init_timer(&dev->timer);
-	dev->timer.function = &awcloud_seconds_handler;
-	dev->timer.expires = jiffies + HZ;
-	add_timer(&dev->timer);
-	atomic_set(&dev->counter, 0);
+	ctx->minor = iminor(inodep);
+	atomic_set(&ctx->counter, 0);
+	atomic_set(&ctx->overrun, 0);
+	mutex_init(&ctx->lock);
+	init_waitqueue_head(&ctx->wait);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+	setup_timer(&ctx->timer, awcloud_seconds_handler, (unsigned long)ctx);
+#else
+	timer_setup(&ctx->timer, awcloud_seconds_handler, 0);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+	hrtimer_init(&ctx->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	ctx->hrtimer.function = awcloud_seconds_hrtimer_handler;
+#else
+	hrtimer_setup(&ctx->hrtimer, awcloud_seconds_hrtimer_handler,
+		CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#endif
+
+#ifdef FMODE_NOWAIT
+	filp->f_mode |= FMODE_NOWAIT;
+#endif
+	filp->private_data = ctx;
+	awcloud_seconds_start(ctx);
 	return 0;
 }
 
 static int release_awcloud_seconds(struct inode *inodep, struct file *filp)
 {
+	struct awcloud_seconds_ctx *ctx =
+		(struct awcloud_seconds_ctx *)filp->private_data;
 
-	struct awcloud_seconds *dev =
-		(struct awcloud_seconds *)filp->private_data;
-
-	del_timer(&dev->timer);
+	awcloud_seconds_stop(ctx);
+	kfree(ctx);
 	return 0;
 }
 
-static ssize_t read_awcloud_seconds(struct file *filp,
-	char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t awcloud_seconds_read(struct kiocb *iocb, struct iov_iter *to,
+	unsigned int *ticks)
 {
-	int ret = 0;
-	struct awcloud_seconds *dev =
-		(struct awcloud_seconds *)filp->private_data;
+	struct file *filp = iocb->ki_filp;
+	struct awcloud_seconds_ctx *ctx =
+		(struct awcloud_seconds_ctx *)filp->private_data;
+	u64 since;
+	int result;
+
+	if (sizeof(unsigned int) > iov_iter_count(to)) {
+		return -EINVAL;
+	}
 
-	ret = atomic_read(&dev->counter);
-	if (put_user(ret, (int *)user_buffer)) {
-		pr_err("Failed to copy to user\n");
+	while (!(*ticks = atomic_xchg(&ctx->counter, 0))) {
+		if ((filp->f_flags & O_NONBLOCK) ||
+			(iocb->ki_flags & IOCB_NOWAIT)) {
+			return -EAGAIN;
+		}
+		since = trace_awcloud_wait_enabled() ? ktime_get_ns() : 0;
+		result = wait_event_interruptible(ctx->wait,
+			atomic_read(&ctx->counter));
+		trace_awcloud_wait(ctx->minor, false, since, result);
+		if (result) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	if (copy_to_iter(ticks, sizeof(*ticks), to) != sizeof(*ticks)) {
+		/* Keep the ticks for the next read rather than lose them */
+		atomic_add(*ticks, &ctx->counter);
 		return -EFAULT;
 	}
 	return sizeof(unsigned int);
 }
 
+static ssize_t read_iter_awcloud_seconds(struct kiocb *iocb,
+	struct iov_iter *to)
+{
+	struct awcloud_seconds_ctx *ctx =
+		(struct awcloud_seconds_ctx *)iocb->ki_filp->private_data;
+	unsigned int ticks = 0;
+	ssize_t ret;
+
+	trace_awcloud_read_enter(ctx->minor, iov_iter_count(to), iocb->ki_pos);
+	ret = awcloud_seconds_read(iocb, to, &ticks);
+	trace_awcloud_read_exit(ctx->minor, ret, ticks);
+
+	return ret;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+unsigned int poll_awcloud_seconds(
+	struct file *filp, struct poll_table_struct *wait)
+{
+	unsigned int mask = 0;
+#else
+__poll_t poll_awcloud_seconds(
+	struct file *filp, struct poll_table_struct *wait)
+{
+	__poll_t mask = 0;
+#endif
+	struct awcloud_seconds_ctx *ctx =
+		(struct awcloud_seconds_ctx *)filp->private_data;
+	unsigned int ticks;
+
+	poll_wait(filp, &ctx->wait, wait);
+	ticks = atomic_read(&ctx->counter);
+	if (ticks) {
+		mask |= POLLIN | POLLRDNORM;
+	}
+	trace_awcloud_poll(ctx->minor, (__force unsigned int)mask, ticks);
+
+	return mask;
+}
+
+/*
+ * SECONDS_SET_PERIOD takes the period in nanoseconds as its argument, 0
+ * goes back to the one second jiffies timer. The counter keeps running
+ * across the switch; the overrun count is returned by SECONDS_GET_OVERRUN.
+ */
+static long awcloud_seconds_ioctl(struct file *filp, unsigned int cmd,
+	unsigned long arg)
+{
+	struct awcloud_seconds_ctx *ctx =
+		(struct awcloud_seconds_ctx *)filp->private_data;
+
+	awcloud_dbg("ioctl", "cmd 0x%x\n", cmd);
+	switch (cmd) {
+	case SECONDS_SET_PERIOD:
+		if (arg && MIN_PERIOD_NS > arg) {
+			return -EINVAL;
+		}
+
+		mutex_lock(&ctx->lock);
+		awcloud_seconds_stop(ctx);
+		ctx->period_ns = arg;
+		awcloud_seconds_start(ctx);
+		mutex_unlock(&ctx->lock);
+		break;
+	case SECONDS_GET_OVERRUN:
+		if (put_user(atomic_read(&ctx->overrun),
+			(unsigned int __user *)arg)) {
+			return -EFAULT;
+		}
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static long ioctl_awcloud_seconds(struct file *filp,
+	unsigned int cmd, unsigned long arg)
+{
+	struct awcloud_seconds_ctx *ctx =
+		(struct awcloud_seconds_ctx *)filp->private_data;
+	long ret;
+
+	trace_awcloud_ioctl_enter(ctx->minor, cmd, arg);
+	ret = awcloud_seconds_ioctl(filp, cmd, arg);
+	trace_awcloud_ioctl_exit(ctx->minor, cmd, ret);
+
+	return ret;
+}
+
+#ifdef CONFIG_COMPAT
+/*
+ * Only SECONDS_GET_OVERRUN passes a pointer; SECONDS_SET_PERIOD passes a
+ * number, which compat_ptr() must not touch, so compat_ptr_ioctl() won't do.
+ */
+static long compat_ioctl_awcloud_seconds(struct file *filp,
+	unsigned int cmd, unsigned long arg)
+{
+	if (SECONDS_GET_OVERRUN == cmd) {
+		arg = (unsigned long)compat_ptr(arg);
+	}
+	return ioctl_awcloud_seconds(filp, cmd, arg);
+}
+#endif
+
 const static struct file_operations awcloud_seconds_fops = {
 	.owner          = THIS_MODULE,
 	.open           = open_awcloud_seconds,
 	.release        = release_awcloud_seconds,
-	.read           = read_awcloud_seconds,
+	.read_iter      = read_iter_awcloud_seconds,
+	.poll           = poll_awcloud_seconds,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl   = compat_ioctl_awcloud_seconds,
+#endif
+	.unlocked_ioctl = ioctl_awcloud_seconds,
 };
 
 static int awcloud_seconds_setup_chrdev(struct awcloud_seconds *dev, int index)
@@ -6,14 +6,50 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/rwsem.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
 #include <linux/device.h>
 #endif
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+/*
+ * Debug messages, off unless enabled through dynamic debug and rate
+ * limited when on. Each one starts with its category (io, seek, ioctl)
+ * so a category can be switched on by itself, e.g.
+ *   echo 'module awcloud format "io: " +p' > /proc/dynamic_debug/control
+ */
+#define awcloud_dbg(cat, fmt, ...) \
+	pr_debug_ratelimited(cat ": " fmt, ##__VA_ARGS__)
+
 #define DEV_NAME "awcloud"
 #define BUFFER_LEN 4096
+#define MAX_STRIPES 16
 #define MEM_CLEAR 0x1
+#define LOCK_STATS_RESET 0x3
+#define STAT_BUCKETS 32
+
+/*
+ * Lock statistics, exported through debugfs. Taking the stripes for one
+ * access counts as one acquisition: its wait runs from the first attempt
+ * until the whole range is held, and its hold from then until the range
+ * is released. Histogram bucket n counts durations in [2^n, 2^(n+1)) ns.
+ */
+struct awcloud_sem_stats {
+	atomic64_t        acquisitions;
+	atomic64_t        contended;
+	atomic64_t        wait_ns;
+	atomic64_t        hold_ns;
+	atomic64_t        wait_hist[STAT_BUCKETS];
+	atomic64_t        hold_hist[STAT_BUCKETS];
+};
 
 struct awcloud_sem {
 	dev_t             dev_id;
@@ -24,15 +60,242 @@ struct awcloud_sem {
 	struct class      *class;
 	struct cdev       *cdev;
 	char              buffer[BUFFER_LEN];
-	struct semaphore  sem;
+	struct semaphore  sem[MAX_STRIPES];
+	struct rw_semaphore rwsem[MAX_STRIPES];
+	struct awcloud_sem_stats stats;
+	struct dentry     *debugfs;
 };
 
 static struct awcloud_sem *dev;
 static unsigned int major;
+static bool rwsem;
+static unsigned int stripes = 1;
+static unsigned int stripe_shift;
+static bool lock_stats;
 module_param(major, uint, 0444);
+module_param(rwsem, bool, 0444);
+MODULE_PARM_DESC(rwsem, "Let readers share the buffer through an rw_semaphore");
+module_param(stripes, uint, 0444);
+MODULE_PARM_DESC(stripes, "Number of range lock stripes, a power of two <= 16");
+module_param(lock_stats, bool, 0644);
+MODULE_PARM_DESC(lock_stats, "Record lock wait and hold times in debugfs");
+
+/* Each stripe gets its own lockdep class so they can be nested */
+static struct lock_class_key awcloud_sem_rwsem_keys[MAX_STRIPES];
+
+/*
+ * The buffer is split into stripes equal ranges with one lock each. An
+ * access takes the stripes it overlaps in ascending order, so accesses to
+ * disjoint ranges run in parallel and overlapping ones cannot deadlock;
+ * MEM_CLEAR simply covers every stripe. With rwsem set, readers hold their
+ * stripes shared and only writers exclude each other.
+ */
+static void awcloud_sem_stripe_range(loff_t pos, size_t count,
+	unsigned int *first, unsigned int *last)
+{
+	loff_t end = count ? pos + count - 1 : pos;
+
+	*first = min_t(loff_t, pos >> stripe_shift, stripes - 1);
+	*last = min_t(loff_t, end >> stripe_shift, stripes - 1);
+}
+
+static bool awcloud_sem_trylock_stripe(struct awcloud_sem *dev, unsigned int i,
+	bool write)
+{
+	if (!rwsem) {
+		return !down_trylock(&dev->sem[i]);
+	}
+	if (write) {
+		return down_write_trylock(&dev->rwsem[i]);
+	}
+	return down_read_trylock(&dev->rwsem[i]);
+}
+
+static int awcloud_sem_lock_stripe(struct awcloud_sem *dev, unsigned int i,
+	bool write)
+{
+	if (!rwsem) {
+		return down_interruptible(&dev->sem[i]) ? -ERESTARTSYS : 0;
+	}
+
+	if (write) {
+		return down_write_killable(&dev->rwsem[i]) ? -ERESTARTSYS : 0;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+	return down_read_interruptible(&dev->rwsem[i]) ? -ERESTARTSYS : 0;
+#else
+	return down_read_killable(&dev->rwsem[i]) ? -ERESTARTSYS : 0;
+#endif
+}
+
+static void awcloud_sem_unlock_stripe(struct awcloud_sem *dev,
+	unsigned int i, bool write)
+{
+	if (!rwsem) {
+		up(&dev->sem[i]);
+	} else if (write) {
+		up_write(&dev->rwsem[i]);
+	} else {
+		up_read(&dev->rwsem[i]);
+	}
+}
+
+static void awcloud_sem_stat_add(atomic64_t *total, atomic64_t *hist, u64 ns)
+{
+	unsigned int bucket = 0;
+
+	if (ns) {
+		bucket = min_t(unsigned int, ilog2(ns), STAT_BUCKETS - 1);
+	}
+	atomic64_add(ns, total);
+	atomic64_inc(&hist[bucket]);
+}
+
+/*
+ * Every stripe is tried without sleeping first, so an acquisition only
+ * counts as contended, and its wait is only traced, when some stripe was
+ * actually busy. *since is the time the range became held, or 0 when
+ * lock_stats is off.
+ */
+static int awcloud_sem_lock_range(struct awcloud_sem *dev, loff_t pos,
+	size_t count, bool write, bool nowait, u64 *since)
+{
+	struct awcloud_sem_stats *stats = &dev->stats;
+	bool timed = READ_ONCE(lock_stats);
+	bool contended = false;
+	unsigned int first;
+	unsigned int last;
+	unsigned int i;
+	u64 start = 0;
+	int ret;
+
+	if (timed || trace_awcloud_wait_enabled()) {
+		start = ktime_get_ns();
+	}
+
+	awcloud_sem_stripe_range(pos, count, &first, &last);
+	for (i = first; i <= last; i++) {
+		if (awcloud_sem_trylock_stripe(dev, i, write)) {
+			continue;
+		}
+		ret = nowait ? -EAGAIN : awcloud_sem_lock_stripe(dev, i, write);
+		if (ret) {
+			trace_awcloud_wait(dev->minor, write, start, ret);
+			while (i-- > first) {
+				awcloud_sem_unlock_stripe(dev, i, write);
+			}
+			return ret;
+		}
+		contended = true;
+	}
+
+	if (contended) {
+		trace_awcloud_wait(dev->minor, write, start, 0);
+	}
+
+	*since = 0;
+	if (timed) {
+		*since = ktime_get_ns();
+		atomic64_inc(&stats->acquisitions);
+		if (contended) {
+			atomic64_inc(&stats->contended);
+		}
+		awcloud_sem_stat_add(&stats->wait_ns, stats->wait_hist,
+			*since - start);
+	}
+
+	return 0;
+}
+
+static void awcloud_sem_unlock_range(struct awcloud_sem *dev, loff_t pos,
+	size_t count, bool write, u64 since)
+{
+	struct awcloud_sem_stats *stats = &dev->stats;
+	unsigned int first;
+	unsigned int last;
+	unsigned int i;
+
+	if (since) {
+		awcloud_sem_stat_add(&stats->hold_ns, stats->hold_hist,
+			ktime_get_ns() - since);
+	}
+
+	awcloud_sem_stripe_range(pos, count, &first, &last);
+	for (i = last + 1; i-- > first; ) {
+		awcloud_sem_unlock_stripe(dev, i, write);
+	}
+}
+
+static int awcloud_sem_lock_read(struct awcloud_sem *dev, loff_t pos,
+	size_t count, bool nowait, u64 *since)
+{
+	return awcloud_sem_lock_range(dev, pos, count, false, nowait, since);
+}
+
+static void awcloud_sem_unlock_read(struct awcloud_sem *dev, loff_t pos,
+	size_t count, u64 since)
+{
+	awcloud_sem_unlock_range(dev, pos, count, false, since);
+}
+
+static int awcloud_sem_lock_write(struct awcloud_sem *dev, loff_t pos,
+	size_t count, bool nowait, u64 *since)
+{
+	return awcloud_sem_lock_range(dev, pos, count, true, nowait, since);
+}
+
+static void awcloud_sem_unlock_write(struct awcloud_sem *dev, loff_t pos,
+	size_t count, u64 since)
+{
+	awcloud_sem_unlock_range(dev, pos, count, true, since);
+}
+
+/* Whole-buffer operations take every stripe */
+static int awcloud_sem_lock_all(struct awcloud_sem *dev, bool nowait,
+	u64 *since)
+{
+	return awcloud_sem_lock_range(dev, 0, BUFFER_LEN, true, nowait, since);
+}
+
+static void awcloud_sem_unlock_all(struct awcloud_sem *dev, u64 since)
+{
+	awcloud_sem_unlock_range(dev, 0, BUFFER_LEN, true, since);
+}
+
+static void awcloud_sem_stats_reset(struct awcloud_sem_stats *stats)
+{
+	unsigned int i;
+
+	atomic64_set(&stats->acquisitions, 0);
+	atomic64_set(&stats->contended, 0);
+	atomic64_set(&stats->wait_ns, 0);
+	atomic64_set(&stats->hold_ns, 0);
+	for (i = 0; i < STAT_BUCKETS; i++) {
+		atomic64_set(&stats->wait_hist[i], 0);
+		atomic64_set(&stats->hold_hist[i], 0);
+	}
+}
+
+/* Writers to different stripes may race to move used_len forward */
+static void awcloud_sem_extend(struct awcloud_sem *dev, unsigned int end)
+{
+	unsigned int used = READ_ONCE(dev->used_len);
+	unsigned int old;
+
+	while (end > used) {
+		old = cmpxchg(&dev->used_len, used, end);
+		if (old == used) {
+			break;
+		}
+		used = old;
+	}
+}
 
 static int open_awcloud_sem(struct inode *inodep, struct file *filp)
 {
+#ifdef FMODE_NOWAIT
+	filp->f_mode |= FMODE_NOWAIT;
+#endif
 	filp->private_data = dev;
 	return 0;
 }
@@ -42,109 +305,128 @@ static int release_awcloud_sem(struct inode *inodep, struct file *filp)
 	return 0;
 }
 
-static ssize_t read_awcloud_sem(struct file *filp,
-	char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t awcloud_sem_read(struct kiocb *iocb, struct iov_iter *to)
 {
-	int ret = 0;
-	struct awcloud_sem *dev = (struct awcloud_sem *)filp->private_data;
-
-	if (*ppos >= BUFFER_LEN) {
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(to);
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_sem *dev =
+		(struct awcloud_sem *)iocb->ki_filp->private_data;
+	u64 since;
+
+	if (pos >= BUFFER_LEN) {
 		return count ? -ENXIO:0;
 	}
 
-	if (count > (BUFFER_LEN - *ppos)) {
-		count = BUFFER_LEN - *ppos;
+	if (count > (BUFFER_LEN - pos)) {
+		count = BUFFER_LEN - pos;
 	}
 
-	if (down_interruptible(&dev->sem)) {
-		return -ERESTARTSYS;
+	ret = awcloud_sem_lock_read(dev, pos, count,
+		iocb->ki_flags & IOCB_NOWAIT, &since);
+	if (ret) {
+		return ret;
 	}
 
-	if (copy_to_user(user_buffer, (void *)(dev->buffer + *ppos), count)) {
-		return -EFAULT;
+	ret = copy_to_iter(dev->buffer + pos, count, to);
+	if (!ret && count) {
+		ret = -EFAULT;
+	} else {
+		iocb->ki_pos = pos + ret;
 	}
 
-	*ppos += count;
-	ret = count;
-
-	up(&dev->sem);
+	awcloud_sem_unlock_read(dev, pos, count, since);
 
 	return ret;
 }
 
-static ssize_t write_awcloud_sem(struct file *filp,
-	const char __user *user_buffer, size_t count, loff_t *ppos)
+static ssize_t read_iter_awcloud_sem(struct kiocb *iocb, struct iov_iter *to)
 {
-	int ret = 0;
+	struct file *filp = iocb->ki_filp;
 	struct awcloud_sem *dev = (struct awcloud_sem *)filp->private_data;
+	unsigned int minor = iminor(file_inode(filp));
+	ssize_t ret;
 
-	if (*ppos >= BUFFER_LEN) {
+	trace_awcloud_read_enter(minor, iov_iter_count(to), iocb->ki_pos);
+	ret = awcloud_sem_read(iocb, to);
+	trace_awcloud_read_exit(minor, ret, dev->used_len);
+
+	return ret;
+}
+
+static ssize_t awcloud_sem_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	ssize_t ret = 0;
+	size_t count = iov_iter_count(from);
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_sem *dev =
+		(struct awcloud_sem *)iocb->ki_filp->private_data;
+	u64 since;
+
+	if (pos >= BUFFER_LEN) {
 		return count ? -ENXIO:0;
 	}
 
-	if (count > BUFFER_LEN - *ppos) {
-		count = BUFFER_LEN - *ppos;
+	if (count > BUFFER_LEN - pos) {
+		count = BUFFER_LEN - pos;
 	}
 
-	pr_info(
-#if defined(__arm__)
-		"Calling the write function with count %d, and ppos %lld\n",
-#else
-		"Calling the write function with count %ld, and ppos %lld\n",
-#endif
-		count, *ppos);
+	awcloud_dbg("io", "write %zu bytes at %lld\n", count, pos);
 
-	if (down_interruptible(&dev->sem)) {
-		return -ERESTARTSYS;
-	}
-
-	if (copy_from_user(dev->buffer + *ppos, user_buffer, count)) {
-		ret = -EFAULT;
+	ret = awcloud_sem_lock_write(dev, pos, count,
+		iocb->ki_flags & IOCB_NOWAIT, &since);
+	if (ret) {
 		return ret;
 	}
 
-	*ppos += count;
-	if (*ppos > dev->used_len) {
-		dev->used_len = *ppos;
+	ret = copy_from_iter(dev->buffer + pos, count, from);
+	if (!ret && count) {
+		ret = -EFAULT;
+	} else {
+		iocb->ki_pos = pos + ret;
+		awcloud_sem_extend(dev, iocb->ki_pos);
 	}
-	ret = count;
 
-	up(&dev->sem);
-	pr_info(
-#if defined(__arm__)
-		"Release the semaphore of write for count %d\n",
-#else
-		"Release the semaphore of write for count %ld\n",
-#endif
-		count);
+	awcloud_sem_unlock_write(dev, pos, count, since);
 
 	return ret;
 }
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
-int ioctl_awcloud_sem(struct inode *inodep,
-	struct file *filp, unsigned int cmd, unsigned long arg)
+static ssize_t write_iter_awcloud_sem(struct kiocb *iocb, struct iov_iter *from)
 {
-#else
-static long ioctl_awcloud_sem(struct file *filp,
-	unsigned int cmd, unsigned long arg)
+	struct file *filp = iocb->ki_filp;
+	struct awcloud_sem *dev = (struct awcloud_sem *)filp->private_data;
+	unsigned int minor = iminor(file_inode(filp));
+	ssize_t ret;
+
+	trace_awcloud_write_enter(minor, iov_iter_count(from), iocb->ki_pos);
+	ret = awcloud_sem_write(iocb, from);
+	trace_awcloud_write_exit(minor, ret, dev->used_len);
+
+	return ret;
+}
+
+static long awcloud_sem_ioctl(struct file *filp, unsigned int cmd,
+	unsigned long arg)
 {
-	//struct inode *inodep = file_inode(filp);
-#endif
 	struct awcloud_sem *dev = (struct awcloud_sem *)filp->private_data;
+	u64 since;
 
 	switch (cmd) {
 	case MEM_CLEAR:
-		if (down_interruptible(&dev->sem)) {
+		if (awcloud_sem_lock_all(dev, false, &since)) {
 			return -ERESTARTSYS;
 		}
 
 		memset(dev->buffer, 0, BUFFER_LEN);
 		dev->used_len = 0;
 
-		up(&dev->sem);
+		awcloud_sem_unlock_all(dev, since);
 
-		pr_info("Set Kernel Buffer to Zero\n");
+		awcloud_dbg("ioctl", "buffer cleared\n");
+		break;
+	case LOCK_STATS_RESET:
+		awcloud_sem_stats_reset(&dev->stats);
 		break;
 	default:
 		return -EINVAL;
@@ -152,15 +434,26 @@ static long ioctl_awcloud_sem(struct file *filp,
 	return 0;
 }
 
+static long ioctl_awcloud_sem(struct file *filp,
+	unsigned int cmd, unsigned long arg)
+{
+	unsigned int minor = iminor(file_inode(filp));
+	long ret;
+
+	trace_awcloud_ioctl_enter(minor, cmd, arg);
+	ret = awcloud_sem_ioctl(filp, cmd, arg);
+	trace_awcloud_ioctl_exit(minor, cmd, ret);
+
+	return ret;
+}
+
 static loff_t llseek_awcloud_sem(struct file *filp,
 	loff_t offset, int whence)
 {
 	loff_t ret = 0;
 	struct awcloud_sem *dev = (struct awcloud_sem *)filp->private_data;
 
-	pr_info(
-		"Calling the llseek function of this device,"
-		"and offset is %lld , whence is %d\n", offset, whence);
+	awcloud_dbg("seek", "offset %lld whence %d\n", offset, whence);
 	switch (whence) {
 	case SEEK_SET:
 		if (offset < 0) {
@@ -210,24 +503,59 @@ static loff_t llseek_awcloud_sem(struct file *filp,
 	return ret;
 }
 
+static int awcloud_sem_stats_show(struct seq_file *m, void *v)
+{
+	struct awcloud_sem_stats *stats = m->private;
+	unsigned int i;
+
+	seq_printf(m, "acquisitions %lld\n",
+		(long long)atomic64_read(&stats->acquisitions));
+	seq_printf(m, "contended %lld\n",
+		(long long)atomic64_read(&stats->contended));
+	seq_printf(m, "wait_ns %lld\n",
+		(long long)atomic64_read(&stats->wait_ns));
+	seq_printf(m, "hold_ns %lld\n",
+		(long long)atomic64_read(&stats->hold_ns));
+	for (i = 0; i < STAT_BUCKETS; i++) {
+		seq_printf(m, "wait_hist %u %lld\n", i,
+			(long long)atomic64_read(&stats->wait_hist[i]));
+	}
+	for (i = 0; i < STAT_BUCKETS; i++) {
+		seq_printf(m, "hold_hist %u %lld\n", i,
+			(long long)atomic64_read(&stats->hold_hist[i]));
+	}
+
+	return 0;
+}
+
+static int awcloud_sem_stats_open(struct inode *inodep, struct file *filp)
+{
+	return single_open(filp, awcloud_sem_stats_show, inodep->i_private);
+}
+
+static const struct file_operations awcloud_sem_stats_fops = {
+	.owner          = THIS_MODULE,
+	.open           = awcloud_sem_stats_open,
+	.read           = seq_read,
+	.llseek         = seq_lseek,
+	.release        = single_release,
+};
+
 static const struct file_operations awcloud_sem_fops = {
-	.owner   = THIS_MODULE,
-	.open    = open_awcloud_sem,
-	.release = release_awcloud_sem,
-	.read    = read_awcloud_sem,
-	.write   = write_awcloud_sem,
-	.llseek  = llseek_awcloud_sem,
-#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 0)
-	.ioctl   = ioctl_awcloud_sem,
-#else
-	.compat_ioctl = ioctl_awcloud_sem,
+	.owner          = THIS_MODULE,
+	.open           = open_awcloud_sem,
+	.release        = release_awcloud_sem,
+	.read_iter      = read_iter_awcloud_sem,
+	.write_iter     = write_iter_awcloud_sem,
+	.llseek         = llseek_awcloud_sem,
+	.compat_ioctl   = ioctl_awcloud_sem,
 	.unlocked_ioctl = ioctl_awcloud_sem,
-#endif
 };
 
 static int awcloud_sem_setup_chrdev(struct awcloud_sem *dev)
 {
 	int result = 0;
+	unsigned int i;
 
 	if (major > 0) {
 		dev->dev_id = MKDEV(major, 0);
@@ -277,11 +605,11 @@ static int awcloud_sem_setup_chrdev(struct awcloud_sem *dev)
 
 	memset(dev->buffer, 0, BUFFER_LEN);
 	dev->used_len = 0;
-#if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 36) && !defined(init_MUTEX)
-	sema_init(&(dev->sem), 1);
-#else
-	init_MUTEX(&(dev->sem));
-#endif
+	for (i = 0; i < MAX_STRIPES; i++) {
+		sema_init(&(dev->sem[i]), 1);
+		init_rwsem(&dev->rwsem[i]);
+		lockdep_set_class(&dev->rwsem[i], &awcloud_sem_rwsem_keys[i]);
+	}
 	return 0;
 
 device_create_err:
@@ -299,6 +627,12 @@ static int __init awcloud_sem_init(void)
 {
 	int result = 0;
 
+	if (!stripes || stripes > MAX_STRIPES || !is_power_of_2(stripes)) {
+		result = -EINVAL;
+		goto finally;
+	}
+	stripe_shift = ilog2(BUFFER_LEN / stripes);
+
 	dev = kzalloc(sizeof(struct awcloud_sem), GFP_KERNEL);
 	if (!dev) {
 		result = -ENOMEM;
@@ -310,12 +644,17 @@ static int __init awcloud_sem_init(void)
 		goto finally;
 	}
 
+	dev->debugfs = debugfs_create_dir(DEV_NAME, NULL);
+	debugfs_create_file("lock_stats", 0444, dev->debugfs, &dev->stats,
+		&awcloud_sem_stats_fops);
+
 finally:
 	return result;
 }
 
 static void __exit awcloud_sem_exit(void)
 {
+	debugfs_remove_recursive(dev->debugfs);
 	device_destroy(dev->class, dev->dev_id);
 	class_destroy(dev->class);
 	cdev_del(dev->cdev);
@@ -0,0 +1,865 @@
+#include <linux/version.h>
+#include <linux/cdev.h>
+#include <linux/fs.h>
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/mutex.h>
+#include <linux/semaphore.h>
+#include <linux/spinlock.h>
+#include <linux/rwsem.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
+#include <linux/device.h>
+#endif
+
+/*
+ * The iov_iter handlers rely on kiocb->ki_flags and IOCB_NOWAIT, so this
+ * module needs Linux 4.13 or later and carries no compat code for the
+ * pre-2.6.36 ioctl prototype or init_MUTEX().
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0)
+#error "awcloud sync needs Linux 4.13 or later"
+#endif
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+#define DEV_NAME "awcloud"
+#define BUFFER_LEN 4096
+#define MEM_CLEAR 0x1
+#define SNAPSHOT_STACK_LEN 256
+
+/*
+ * One published version of the buffer for the rcu strategy. Every write
+ * publishes a new one, so they come from their own cache: exactly sized,
+ * rather than spilling over into the 8 KiB kmalloc slab.
+ */
+struct awcloud_sync_buf {
+	struct rcu_head   rcu;
+	char              data[BUFFER_LEN];
+};
+
+/*
+ * Per open file state. The spinlock, seqlock and rcu strategies cannot
+ * copy to or from userspace with the buffer held, so they go through a
+ * bounce buffer; each file brings its own, so that allocator cost does
+ * not end up in the numbers being compared. busy guards it against
+ * threads sharing the file, which fall back to allocating.
+ */
+struct awcloud_sync_file {
+	struct awcloud_sync *dev;
+	unsigned long     busy;
+	char              bounce[BUFFER_LEN];
+};
+
+/*
+ * The buffer of the mutex, semaphore and atomic devices with the way it
+ * is protected chosen at load time. Only the lock of that strategy is
+ * ever touched, and each strategy has its own fops, so the I/O paths
+ * never branch on it.
+ */
+struct awcloud_sync {
+	dev_t             dev_id;
+	unsigned int      major;
+	unsigned int      minor;
+	unsigned int      used_len;
+	struct device     *device;
+	struct class      *class;
+	struct cdev       *cdev;
+	char              buffer[BUFFER_LEN];
+	struct mutex      mutex;
+	struct semaphore  sem;
+	spinlock_t        lock;
+	struct rw_semaphore rwsem;
+	seqlock_t         seqlock;
+	struct awcloud_sync_buf __rcu *buf;
+};
+
+static struct awcloud_sync *dev;
+static struct kmem_cache *awcloud_sync_buf_cache;
+static unsigned int major;
+static char *strategy = "mutex";
+module_param(major, uint, 0444);
+module_param(strategy, charp, 0444);
+MODULE_PARM_DESC(strategy,
+	"none, mutex, semaphore, spinlock, rwsem, seqlock or rcu");
+
+static inline struct awcloud_sync_file *awcloud_sync_file(struct file *filp)
+{
+	return (struct awcloud_sync_file *)filp->private_data;
+}
+
+static int open_awcloud_sync(struct inode *inodep, struct file *filp)
+{
+	struct awcloud_sync_file *file;
+
+	file = kmalloc(sizeof(*file), GFP_KERNEL);
+	if (!file) {
+		return -ENOMEM;
+	}
+	file->dev = dev;
+	file->busy = 0;
+
+#ifdef FMODE_NOWAIT
+	filp->f_mode |= FMODE_NOWAIT;
+#endif
+	filp->private_data = file;
+	return 0;
+}
+
+static int release_awcloud_sync(struct inode *inodep, struct file *filp)
+{
+	kfree(awcloud_sync_file(filp));
+	return 0;
+}
+
+/*
+ * Clamp an access at pos to the buffer. Returns the number of bytes to
+ * copy, or a negative error; both of the latter mean the access is over.
+ */
+static ssize_t awcloud_sync_clamp(loff_t pos, size_t count)
+{
+	if (pos >= BUFFER_LEN) {
+		return count ? -ENXIO:0;
+	}
+
+	return min_t(size_t, count, BUFFER_LEN - pos);
+}
+
+/*
+ * Strategies that copy to or from userspace while holding their lock. The
+ * lock expressions return non-zero on failure and the trylock ones true
+ * on success, like the primitives they wrap.
+ */
+#define AWCLOUD_SYNC_DIRECT(_name, _rtry, _rlock, _runlock,		\
+	_wtry, _wlock, _wunlock)					\
+static ssize_t awcloud_sync_read_##_name(struct kiocb *iocb,		\
+	struct iov_iter *to)						\
+{									\
+	ssize_t ret = 0;						\
+	loff_t pos = iocb->ki_pos;					\
+	struct awcloud_sync *dev =					\
+		awcloud_sync_file(iocb->ki_filp)->dev;			\
+	ssize_t count = awcloud_sync_clamp(pos, iov_iter_count(to));	\
+									\
+	if (count <= 0) {						\
+		return count;						\
+	}								\
+									\
+	if (iocb->ki_flags & IOCB_NOWAIT) {				\
+		if (!(_rtry)) {						\
+			return -EAGAIN;					\
+		}							\
+	} else if (_rlock) {						\
+		return -ERESTARTSYS;					\
+	}								\
+									\
+	ret = copy_to_iter(dev->buffer + pos, count, to);		\
+	_runlock;							\
+	if (!ret) {							\
+		return -EFAULT;						\
+	}								\
+	iocb->ki_pos = pos + ret;					\
+									\
+	return ret;							\
+}									\
+									\
+static ssize_t awcloud_sync_write_##_name(struct kiocb *iocb,		\
+	struct iov_iter *from)						\
+{									\
+	ssize_t ret = 0;						\
+	loff_t pos = iocb->ki_pos;					\
+	struct awcloud_sync *dev =					\
+		awcloud_sync_file(iocb->ki_filp)->dev;			\
+	ssize_t count = awcloud_sync_clamp(pos, iov_iter_count(from));	\
+									\
+	if (count <= 0) {						\
+		return count;						\
+	}								\
+									\
+	if (iocb->ki_flags & IOCB_NOWAIT) {				\
+		if (!(_wtry)) {						\
+			return -EAGAIN;					\
+		}							\
+	} else if (_wlock) {						\
+		return -ERESTARTSYS;					\
+	}								\
+									\
+	ret = copy_from_iter(dev->buffer + pos, count, from);		\
+	if (ret && pos + ret > dev->used_len) {				\
+		dev->used_len = pos + ret;				\
+	}								\
+	_wunlock;							\
+	if (!ret) {							\
+		return -EFAULT;						\
+	}								\
+	iocb->ki_pos = pos + ret;					\
+									\
+	return ret;							\
+}									\
+									\
+static long awcloud_sync_ioctl_##_name(struct file *filp,		\
+	unsigned int cmd, unsigned long arg)				\
+{									\
+	struct awcloud_sync *dev = awcloud_sync_file(filp)->dev;	\
+									\
+	if (MEM_CLEAR != cmd) {						\
+		return -EINVAL;						\
+	}								\
+	if (_wlock) {							\
+		return -ERESTARTSYS;					\
+	}								\
+	memset(dev->buffer, 0, BUFFER_LEN);				\
+	dev->used_len = 0;						\
+	_wunlock;							\
+									\
+	return 0;							\
+}
+
+AWCLOUD_SYNC_DIRECT(none,
+	true, 0, (void)0,
+	true, 0, (void)0)
+AWCLOUD_SYNC_DIRECT(mutex,
+	mutex_trylock(&dev->mutex), mutex_lock_interruptible(&dev->mutex),
+	mutex_unlock(&dev->mutex),
+	mutex_trylock(&dev->mutex), mutex_lock_interruptible(&dev->mutex),
+	mutex_unlock(&dev->mutex))
+AWCLOUD_SYNC_DIRECT(semaphore,
+	!down_trylock(&dev->sem), down_interruptible(&dev->sem),
+	up(&dev->sem),
+	!down_trylock(&dev->sem), down_interruptible(&dev->sem),
+	up(&dev->sem))
+AWCLOUD_SYNC_DIRECT(rwsem,
+	down_read_trylock(&dev->rwsem), down_read_killable(&dev->rwsem),
+	up_read(&dev->rwsem),
+	down_write_trylock(&dev->rwsem), down_write_killable(&dev->rwsem),
+	up_write(&dev->rwsem))
+
+/*
+ * The remaining strategies cannot fault while they hold the buffer, so
+ * reads go through a snapshot and writes through a bounce buffer: on the
+ * stack for small accesses, the file's own otherwise. Only a file used by
+ * several threads at once has to allocate.
+ */
+static char *awcloud_sync_bounce(struct awcloud_sync_file *file,
+	char *stack, size_t count, bool nowait)
+{
+	if (count <= SNAPSHOT_STACK_LEN) {
+		return stack;
+	}
+	if (!test_and_set_bit_lock(0, &file->busy)) {
+		return file->bounce;
+	}
+
+	return kmalloc(count, nowait ? GFP_NOWAIT : GFP_KERNEL);
+}
+
+static void awcloud_sync_bounce_free(struct awcloud_sync_file *file,
+	char *stack, char *bounce)
+{
+	if (bounce == file->bounce) {
+		clear_bit_unlock(0, &file->busy);
+	} else if (bounce != stack) {
+		kfree(bounce);
+	}
+}
+
+static ssize_t awcloud_sync_read_spinlock(struct kiocb *iocb,
+	struct iov_iter *to)
+{
+	ssize_t ret = 0;
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_sync_file *file = awcloud_sync_file(iocb->ki_filp);
+	struct awcloud_sync *dev = file->dev;
+	ssize_t count = awcloud_sync_clamp(pos, iov_iter_count(to));
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	char stack[SNAPSHOT_STACK_LEN];
+	char *snapshot;
+
+	if (count <= 0) {
+		return count;
+	}
+
+	snapshot = awcloud_sync_bounce(file, stack, count, nowait);
+	if (!snapshot) {
+		return nowait ? -EAGAIN : -ENOMEM;
+	}
+
+	spin_lock(&dev->lock);
+	memcpy(snapshot, dev->buffer + pos, count);
+	spin_unlock(&dev->lock);
+
+	ret = copy_to_iter(snapshot, count, to);
+	awcloud_sync_bounce_free(file, stack, snapshot);
+	if (!ret) {
+		return -EFAULT;
+	}
+	iocb->ki_pos = pos + ret;
+
+	return ret;
+}
+
+static ssize_t awcloud_sync_write_spinlock(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	ssize_t ret = 0;
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_sync_file *file = awcloud_sync_file(iocb->ki_filp);
+	struct awcloud_sync *dev = file->dev;
+	ssize_t count = awcloud_sync_clamp(pos, iov_iter_count(from));
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	char stack[SNAPSHOT_STACK_LEN];
+	char *bounce;
+
+	if (count <= 0) {
+		return count;
+	}
+
+	bounce = awcloud_sync_bounce(file, stack, count, nowait);
+	if (!bounce) {
+		return nowait ? -EAGAIN : -ENOMEM;
+	}
+
+	ret = copy_from_iter(bounce, count, from);
+	if (ret) {
+		spin_lock(&dev->lock);
+		memcpy(dev->buffer + pos, bounce, ret);
+		if (pos + ret > dev->used_len) {
+			dev->used_len = pos + ret;
+		}
+		spin_unlock(&dev->lock);
+	}
+
+	awcloud_sync_bounce_free(file, stack, bounce);
+	if (!ret) {
+		return -EFAULT;
+	}
+	iocb->ki_pos = pos + ret;
+
+	return ret;
+}
+
+static long awcloud_sync_ioctl_spinlock(struct file *filp,
+	unsigned int cmd, unsigned long arg)
+{
+	struct awcloud_sync *dev = awcloud_sync_file(filp)->dev;
+
+	if (MEM_CLEAR != cmd) {
+		return -EINVAL;
+	}
+
+	spin_lock(&dev->lock);
+	memset(dev->buffer, 0, BUFFER_LEN);
+	dev->used_len = 0;
+	spin_unlock(&dev->lock);
+
+	return 0;
+}
+
+static ssize_t awcloud_sync_read_seqlock(struct kiocb *iocb,
+	struct iov_iter *to)
+{
+	ssize_t ret = 0;
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_sync_file *file = awcloud_sync_file(iocb->ki_filp);
+	struct awcloud_sync *dev = file->dev;
+	ssize_t count = awcloud_sync_clamp(pos, iov_iter_count(to));
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	char stack[SNAPSHOT_STACK_LEN];
+	char *snapshot;
+	unsigned int seq;
+
+	if (count <= 0) {
+		return count;
+	}
+
+	snapshot = awcloud_sync_bounce(file, stack, count, nowait);
+	if (!snapshot) {
+		return nowait ? -EAGAIN : -ENOMEM;
+	}
+
+	do {
+		seq = read_seqbegin(&dev->seqlock);
+		memcpy(snapshot, dev->buffer + pos, count);
+	} while (read_seqretry(&dev->seqlock, seq));
+
+	ret = copy_to_iter(snapshot, count, to);
+	awcloud_sync_bounce_free(file, stack, snapshot);
+	if (!ret) {
+		return -EFAULT;
+	}
+	iocb->ki_pos = pos + ret;
+
+	return ret;
+}
+
+static ssize_t awcloud_sync_write_seqlock(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	ssize_t ret = 0;
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_sync_file *file = awcloud_sync_file(iocb->ki_filp);
+	struct awcloud_sync *dev = file->dev;
+	ssize_t count = awcloud_sync_clamp(pos, iov_iter_count(from));
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	char stack[SNAPSHOT_STACK_LEN];
+	char *bounce;
+
+	if (count <= 0) {
+		return count;
+	}
+
+	bounce = awcloud_sync_bounce(file, stack, count, nowait);
+	if (!bounce) {
+		return nowait ? -EAGAIN : -ENOMEM;
+	}
+
+	ret = copy_from_iter(bounce, count, from);
+	if (ret) {
+		write_seqlock(&dev->seqlock);
+		memcpy(dev->buffer + pos, bounce, ret);
+		if (pos + ret > dev->used_len) {
+			dev->used_len = pos + ret;
+		}
+		write_sequnlock(&dev->seqlock);
+	}
+
+	awcloud_sync_bounce_free(file, stack, bounce);
+	if (!ret) {
+		return -EFAULT;
+	}
+	iocb->ki_pos = pos + ret;
+
+	return ret;
+}
+
+static long awcloud_sync_ioctl_seqlock(struct file *filp,
+	unsigned int cmd, unsigned long arg)
+{
+	struct awcloud_sync *dev = awcloud_sync_file(filp)->dev;
+
+	if (MEM_CLEAR != cmd) {
+		return -EINVAL;
+	}
+
+	write_seqlock(&dev->seqlock);
+	memset(dev->buffer, 0, BUFFER_LEN);
+	dev->used_len = 0;
+	write_sequnlock(&dev->seqlock);
+
+	return 0;
+}
+
+/*
+ * rcu readers copy the current version out under rcu_read_lock() and
+ * never wait. Writers serialize on the mutex, publish a modified copy and
+ * free the old version after a grace period.
+ */
+static ssize_t awcloud_sync_read_rcu(struct kiocb *iocb,
+	struct iov_iter *to)
+{
+	ssize_t ret = 0;
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_sync_file *file = awcloud_sync_file(iocb->ki_filp);
+	struct awcloud_sync *dev = file->dev;
+	ssize_t count = awcloud_sync_clamp(pos, iov_iter_count(to));
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	char stack[SNAPSHOT_STACK_LEN];
+	char *snapshot;
+
+	if (count <= 0) {
+		return count;
+	}
+
+	snapshot = awcloud_sync_bounce(file, stack, count, nowait);
+	if (!snapshot) {
+		return nowait ? -EAGAIN : -ENOMEM;
+	}
+
+	rcu_read_lock();
+	memcpy(snapshot, rcu_dereference(dev->buf)->data + pos, count);
+	rcu_read_unlock();
+
+	ret = copy_to_iter(snapshot, count, to);
+	awcloud_sync_bounce_free(file, stack, snapshot);
+	if (!ret) {
+		return -EFAULT;
+	}
+	iocb->ki_pos = pos + ret;
+
+	return ret;
+}
+
+static void awcloud_sync_buf_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(awcloud_sync_buf_cache,
+		container_of(head, struct awcloud_sync_buf, rcu));
+}
+
+static void awcloud_sync_publish(struct awcloud_sync *dev,
+	struct awcloud_sync_buf *buf)
+{
+	struct awcloud_sync_buf *old;
+
+	old = rcu_dereference_protected(dev->buf,
+		lockdep_is_held(&dev->mutex));
+	rcu_assign_pointer(dev->buf, buf);
+	call_rcu(&old->rcu, awcloud_sync_buf_free_rcu);
+}
+
+static ssize_t awcloud_sync_write_rcu(struct kiocb *iocb,
+	struct iov_iter *from)
+{
+	ssize_t ret = 0;
+	loff_t pos = iocb->ki_pos;
+	struct awcloud_sync *dev =
+		awcloud_sync_file(iocb->ki_filp)->dev;
+	ssize_t count = awcloud_sync_clamp(pos, iov_iter_count(from));
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+	struct awcloud_sync_buf *buf;
+
+	if (count <= 0) {
+		return count;
+	}
+
+	buf = kmem_cache_alloc(awcloud_sync_buf_cache,
+		nowait ? GFP_NOWAIT : GFP_KERNEL);
+	if (!buf) {
+		return nowait ? -EAGAIN : -ENOMEM;
+	}
+
+	if (nowait) {
+		if (!mutex_trylock(&dev->mutex)) {
+			kmem_cache_free(awcloud_sync_buf_cache, buf);
+			return -EAGAIN;
+		}
+	} else if (mutex_lock_interruptible(&dev->mutex)) {
+		kmem_cache_free(awcloud_sync_buf_cache, buf);
+		return -ERESTARTSYS;
+	}
+
+	memcpy(buf->data, rcu_dereference_protected(dev->buf,
+		lockdep_is_held(&dev->mutex))->data, BUFFER_LEN);
+	ret = copy_from_iter(buf->data + pos, count, from);
+	if (ret) {
+		awcloud_sync_publish(dev, buf);
+		if (pos + ret > dev->used_len) {
+			dev->used_len = pos + ret;
+		}
+	} else {
+		kmem_cache_free(awcloud_sync_buf_cache, buf);
+	}
+
+	mutex_unlock(&dev->mutex);
+	if (!ret) {
+		return -EFAULT;
+	}
+	iocb->ki_pos = pos + ret;
+
+	return ret;
+}
+
+static long awcloud_sync_ioctl_rcu(struct file *filp,
+	unsigned int cmd, unsigned long arg)
+{
+	struct awcloud_sync *dev = awcloud_sync_file(filp)->dev;
+	struct awcloud_sync_buf *buf;
+
+	if (MEM_CLEAR != cmd) {
+		return -EINVAL;
+	}
+
+	buf = kmem_cache_zalloc(awcloud_sync_buf_cache, GFP_KERNEL);
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	if (mutex_lock_interruptible(&dev->mutex)) {
+		kmem_cache_free(awcloud_sync_buf_cache, buf);
+		return -ERESTARTSYS;
+	}
+
+	awcloud_sync_publish(dev, buf);
+	dev->used_len = 0;
+
+	mutex_unlock(&dev->mutex);
+
+	return 0;
+}
+
+static loff_t llseek_awcloud_sync(struct file *filp,
+	loff_t offset, int whence)
+{
+	loff_t ret = 0;
+	struct awcloud_sync *dev = awcloud_sync_file(filp)->dev;
+
+	switch (whence) {
+	case SEEK_SET:
+		break;
+	case SEEK_CUR:
+		offset += filp->f_pos;
+		break;
+	case SEEK_END:
+		offset += READ_ONCE(dev->used_len);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (offset < 0 || offset > BUFFER_LEN) {
+		ret = -EINVAL;
+	} else {
+		filp->f_pos = offset;
+		ret = filp->f_pos;
+	}
+
+	return ret;
+}
+
+/*
+ * Entry and exit tracepoints around a strategy's handlers. The handler is
+ * a constant at each call site, so this inlines down to a direct call.
+ */
+static __always_inline ssize_t awcloud_sync_traced_io(struct kiocb *iocb,
+	struct iov_iter *iter, bool write,
+	ssize_t (*io)(struct kiocb *, struct iov_iter *))
+{
+	struct awcloud_sync *dev =
+		awcloud_sync_file(iocb->ki_filp)->dev;
+	unsigned int minor = iminor(file_inode(iocb->ki_filp));
+	size_t count = iov_iter_count(iter);
+	ssize_t ret;
+
+	if (write) {
+		trace_awcloud_write_enter(minor, count, iocb->ki_pos);
+	} else {
+		trace_awcloud_read_enter(minor, count, iocb->ki_pos);
+	}
+	ret = io(iocb, iter);
+	if (write) {
+		trace_awcloud_write_exit(minor, ret, dev->used_len);
+	} else {
+		trace_awcloud_read_exit(minor, ret, dev->used_len);
+	}
+
+	return ret;
+}
+
+static __always_inline long awcloud_sync_traced_ioctl(struct file *filp,
+	unsigned int cmd, unsigned long arg,
+	long (*ioctl)(struct file *, unsigned int, unsigned long))
+{
+	unsigned int minor = iminor(file_inode(filp));
+	long ret;
+
+	trace_awcloud_ioctl_enter(minor, cmd, arg);
+	ret = ioctl(filp, cmd, arg);
+	trace_awcloud_ioctl_exit(minor, cmd, ret);
+
+	return ret;
+}
+
+#define AWCLOUD_SYNC_FOPS(_name)					\
+static ssize_t read_iter_awcloud_sync_##_name(struct kiocb *iocb,	\
+	struct iov_iter *to)						\
+{									\
+	return awcloud_sync_traced_io(iocb, to, false,			\
+		awcloud_sync_read_##_name);				\
+}									\
+									\
+static ssize_t write_iter_awcloud_sync_##_name(struct kiocb *iocb,	\
+	struct iov_iter *from)						\
+{									\
+	return awcloud_sync_traced_io(iocb, from, true,			\
+		awcloud_sync_write_##_name);				\
+}									\
+									\
+static long ioctl_awcloud_sync_##_name(struct file *filp,		\
+	unsigned int cmd, unsigned long arg)				\
+{									\
+	return awcloud_sync_traced_ioctl(filp, cmd, arg,		\
+		awcloud_sync_ioctl_##_name);				\
+}									\
+									\
+static const struct file_operations awcloud_sync_##_name##_fops = {	\
+	.owner          = THIS_MODULE,					\
+	.open           = open_awcloud_sync,				\
+	.release        = release_awcloud_sync,				\
+	.read_iter      = read_iter_awcloud_sync_##_name,		\
+	.write_iter     = write_iter_awcloud_sync_##_name,		\
+	.llseek         = llseek_awcloud_sync,				\
+	.compat_ioctl   = ioctl_awcloud_sync_##_name,			\
+	.unlocked_ioctl = ioctl_awcloud_sync_##_name,			\
+}
+
+AWCLOUD_SYNC_FOPS(none);
+AWCLOUD_SYNC_FOPS(mutex);
+AWCLOUD_SYNC_FOPS(semaphore);
+AWCLOUD_SYNC_FOPS(spinlock);
+AWCLOUD_SYNC_FOPS(rwsem);
+AWCLOUD_SYNC_FOPS(seqlock);
+AWCLOUD_SYNC_FOPS(rcu);
+
+static const struct {
+	const char                   *name;
+	const struct file_operations *fops;
+} awcloud_sync_strategies[] = {
+	{ "none",      &awcloud_sync_none_fops },
+	{ "mutex",     &awcloud_sync_mutex_fops },
+	{ "semaphore", &awcloud_sync_semaphore_fops },
+	{ "spinlock",  &awcloud_sync_spinlock_fops },
+	{ "rwsem",     &awcloud_sync_rwsem_fops },
+	{ "seqlock",   &awcloud_sync_seqlock_fops },
+	{ "rcu",       &awcloud_sync_rcu_fops },
+};
+
+static int awcloud_sync_setup_chrdev(struct awcloud_sync *dev,
+	const struct file_operations *fops)
+{
+	int result = 0;
+
+	if (major > 0) {
+		dev->dev_id = MKDEV(major, 0);
+		result = register_chrdev_region(dev->dev_id, 1, DEV_NAME);
+	} else {
+		result = alloc_chrdev_region(&(dev->dev_id), 0, 1, DEV_NAME);
+	}
+	if (result) {
+		pr_err("Failed to register the char device\n");
+		result = -EFAULT;
+		goto chrdev_region_err;
+	}
+
+	dev->major = MAJOR(dev->dev_id);
+	dev->minor = MINOR(dev->dev_id);
+
+	dev->cdev = cdev_alloc();
+	if (!dev->cdev) {
+		pr_err("Failed to alloc cdev struct\n");
+		result = -EFAULT;
+		goto cdev_alloc_err;
+	}
+
+	dev->cdev->owner = THIS_MODULE;
+
+	cdev_init(dev->cdev, fops);
+
+	result = cdev_add(dev->cdev, dev->dev_id, 1);
+	if (result) {
+		pr_err("Failed to add awcloud_sync into Linux system\n");
+		result = -EFAULT;
+		goto cdev_add_err;
+	}
+
+	dev->class = class_create(THIS_MODULE, DEV_NAME);
+	if (IS_ERR(dev->class)) {
+		result = PTR_ERR(dev->class);
+		goto class_create_err;
+	}
+
+	dev->device = device_create(dev->class, NULL,
+		dev->dev_id, NULL, DEV_NAME);
+	if (IS_ERR(dev->device)) {
+		result = PTR_ERR(dev->device);
+		goto device_create_err;
+	}
+
+	return 0;
+
+device_create_err:
+	class_destroy(dev->class);
+class_create_err:
+	cdev_del(dev->cdev);
+cdev_alloc_err:
+cdev_add_err:
+	unregister_chrdev_region(dev->dev_id, 1);
+chrdev_region_err:
+	return result;
+}
+
+static int __init awcloud_sync_init(void)
+{
+	const struct file_operations *fops = NULL;
+	int result = 0;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(awcloud_sync_strategies); i++) {
+		if (sysfs_streq(strategy, awcloud_sync_strategies[i].name)) {
+			fops = awcloud_sync_strategies[i].fops;
+			break;
+		}
+	}
+	if (!fops) {
+		pr_err("Unknown sync strategy %s\n", strategy);
+		result = -EINVAL;
+		goto finally;
+	}
+
+	awcloud_sync_buf_cache = kmem_cache_create("awcloud_sync_buf",
+		sizeof(struct awcloud_sync_buf), 0, 0, NULL);
+	if (!awcloud_sync_buf_cache) {
+		result = -ENOMEM;
+		goto finally;
+	}
+
+	dev = kzalloc(sizeof(struct awcloud_sync), GFP_KERNEL);
+	if (!dev) {
+		kmem_cache_destroy(awcloud_sync_buf_cache);
+		result = -ENOMEM;
+		goto finally;
+	}
+
+	mutex_init(&dev->mutex);
+	sema_init(&dev->sem, 1);
+	spin_lock_init(&dev->lock);
+	init_rwsem(&dev->rwsem);
+	seqlock_init(&dev->seqlock);
+	RCU_INIT_POINTER(dev->buf,
+		kmem_cache_zalloc(awcloud_sync_buf_cache, GFP_KERNEL));
+	if (!rcu_access_pointer(dev->buf)) {
+		kfree(dev);
+		kmem_cache_destroy(awcloud_sync_buf_cache);
+		result = -ENOMEM;
+		goto finally;
+	}
+
+	result = awcloud_sync_setup_chrdev(dev, fops);
+	if (0 > result) {
+		kmem_cache_free(awcloud_sync_buf_cache,
+			rcu_access_pointer(dev->buf));
+		kfree(dev);
+		kmem_cache_destroy(awcloud_sync_buf_cache);
+		goto finally;
+	}
+
+	pr_info("Protecting the buffer with %s\n", strategy);
+
+finally:
+	return result;
+}
+
+static void __exit awcloud_sync_exit(void)
+{
+	device_destroy(dev->class, dev->dev_id);
+	class_destroy(dev->class);
+	cdev_del(dev->cdev);
+	unregister_chrdev_region(dev->dev_id, 1);
+	kmem_cache_free(awcloud_sync_buf_cache, rcu_access_pointer(dev->buf));
+	kfree(dev);
+	/* Let the versions still waiting for a grace period go back first */
+	rcu_barrier();
+	kmem_cache_destroy(awcloud_sync_buf_cache);
+}
+
+module_init(awcloud_sync_init);
+module_exit(awcloud_sync_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("zhangjl@awcloud.com");
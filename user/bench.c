@@ -0,0 +1,470 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Load generator for the awcloud devices:
+ *
+ *   gcc -O2 -pthread -o bench bench.c
+ *   ./bench -d /dev/awcloud -r 8 -w 2 -s 64 -t 10 -c 0-3
+ *
+ * Every thread gets its own file, opened read-only for readers and
+ * write-only for writers so single-reader/single-writer devices accept
+ * them, and issues pread()/pwrite() of one message until the run is
+ * over, timing each call. The result is printed as one JSON object on
+ * stdout.
+ */
+
+#define DEFAULT_DEVICE "/dev/awcloud"
+#define DEFAULT_SAMPLES (1 << 20)
+#define BUFFER_LEN 4096
+
+struct bench_config {
+	const char   *device;
+	int          readers;
+	int          writers;
+	size_t       size;
+	int          seconds;
+	int          nonblock;
+	int          partition;
+	size_t       samples;
+	int          *cpus;
+	int          nr_cpus;
+};
+
+/*
+ * Latencies are kept in a fixed-size reservoir per thread, so long runs
+ * neither run out of memory nor bias the percentiles towards the start.
+ */
+struct bench_thread {
+	pthread_t    thread;
+	int          id;
+	int          writer;
+	int          cpu;
+	int          fd;
+	char         *buffer;
+	uint64_t     ops;
+	uint64_t     bytes;
+	uint64_t     again;
+	uint64_t     empty;
+	uint64_t     errors;
+	uint64_t     seen;
+	uint64_t     *lat;
+	size_t       nr_lat;
+	unsigned int seed;
+};
+
+/*
+ * A merged latency sample. Once a thread has done more ops than fit in
+ * its reservoir, each of its samples stands for seen / nr_lat ops, so
+ * samples are weighted by that when the reservoirs are merged; otherwise
+ * slow threads, which fill their reservoir less, would weigh more.
+ */
+struct bench_sample {
+	uint64_t     ns;
+	double       weight;
+};
+
+struct bench_result {
+	uint64_t     ops;
+	uint64_t     bytes;
+	uint64_t     again;
+	uint64_t     empty;
+	uint64_t     errors;
+	struct bench_sample *lat;
+	size_t       nr_lat;
+	double       weight;
+};
+
+static struct bench_config config = {
+	.device    = DEFAULT_DEVICE,
+	.readers   = 1,
+	.writers   = 1,
+	.size      = 64,
+	.seconds   = 5,
+	.samples   = DEFAULT_SAMPLES,
+};
+
+static volatile int running = 1;
+static pthread_barrier_t start_barrier;
+
+/* Only there to interrupt threads blocked in the device at the end */
+static void wakeup_handler(int sig)
+{
+	(void)sig;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record_latency(struct bench_thread *t, uint64_t ns)
+{
+	uint64_t slot;
+
+	t->seen++;
+	if (t->nr_lat < config.samples) {
+		t->lat[t->nr_lat++] = ns;
+		return;
+	}
+	slot = ((uint64_t)rand_r(&t->seed) << 31 | rand_r(&t->seed)) % t->seen;
+	if (slot < config.samples) {
+		t->lat[slot] = ns;
+	}
+}
+
+static void *bench_worker(void *arg)
+{
+	struct bench_thread *t = arg;
+	cpu_set_t set;
+	off_t offset = 0;
+	uint64_t start;
+	ssize_t len;
+
+	if (0 <= t->cpu) {
+		CPU_ZERO(&set);
+		CPU_SET(t->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+			fprintf(stderr, "Cannot pin thread %d to cpu %d\n",
+				t->id, t->cpu);
+		}
+	}
+
+	/* Give every thread its own slice so striped devices can scale */
+	if (config.partition) {
+		offset = (t->id * config.size) % BUFFER_LEN;
+	}
+
+	pthread_barrier_wait(&start_barrier);
+
+	while (running) {
+		start = now_ns();
+		if (t->writer) {
+			len = pwrite(t->fd, t->buffer, config.size, offset);
+		} else {
+			len = pread(t->fd, t->buffer, config.size, offset);
+		}
+		if (0 > len) {
+			if (EAGAIN == errno) {
+				t->again++;
+			} else if (EINTR != errno) {
+				t->errors++;
+			}
+			continue;
+		}
+		/* Nothing to read (or room to write) is not a completed op */
+		if (!len) {
+			t->empty++;
+			continue;
+		}
+		record_latency(t, now_ns() - start);
+		t->ops++;
+		t->bytes += len;
+	}
+
+	return NULL;
+}
+
+static int compare_sample(const void *a, const void *b)
+{
+	uint64_t x = ((const struct bench_sample *)a)->ns;
+	uint64_t y = ((const struct bench_sample *)b)->ns;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const struct bench_result *r, double p)
+{
+	double target = p * r->weight;
+	double sum = 0;
+	size_t i;
+
+	for (i = 0; i < r->nr_lat; i++) {
+		sum += r->lat[i].weight;
+		if (sum >= target) {
+			return r->lat[i].ns;
+		}
+	}
+	return r->nr_lat ? r->lat[r->nr_lat - 1].ns : 0;
+}
+
+static int collect(struct bench_thread *threads, int nr, int writer,
+	struct bench_result *r)
+{
+	size_t total = 0;
+	double weight;
+	size_t j;
+	int i;
+
+	memset(r, 0, sizeof(*r));
+	for (i = 0; i < nr; i++) {
+		if (threads[i].writer == writer) {
+			total += threads[i].nr_lat;
+		}
+	}
+
+	r->lat = malloc((total ? total : 1) * sizeof(*r->lat));
+	if (!r->lat) {
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (threads[i].writer != writer) {
+			continue;
+		}
+		r->ops += threads[i].ops;
+		r->bytes += threads[i].bytes;
+		r->again += threads[i].again;
+		r->empty += threads[i].empty;
+		r->errors += threads[i].errors;
+		if (!threads[i].nr_lat) {
+			continue;
+		}
+		weight = (double)threads[i].seen / threads[i].nr_lat;
+		for (j = 0; j < threads[i].nr_lat; j++) {
+			r->lat[r->nr_lat].ns = threads[i].lat[j];
+			r->lat[r->nr_lat].weight = weight;
+			r->nr_lat++;
+		}
+		r->weight += threads[i].seen;
+	}
+	qsort(r->lat, r->nr_lat, sizeof(*r->lat), compare_sample);
+
+	return 0;
+}
+
+static void print_result(const char *name, const struct bench_result *r,
+	double elapsed, int last)
+{
+	printf("  \"%s\": {\n", name);
+	printf("    \"ops\": %llu,\n", (unsigned long long)r->ops);
+	printf("    \"bytes\": %llu,\n", (unsigned long long)r->bytes);
+	printf("    \"eagain\": %llu,\n", (unsigned long long)r->again);
+	printf("    \"empty\": %llu,\n", (unsigned long long)r->empty);
+	printf("    \"errors\": %llu,\n", (unsigned long long)r->errors);
+	printf("    \"ops_per_sec\": %.1f,\n", r->ops / elapsed);
+	printf("    \"mb_per_sec\": %.3f,\n", r->bytes / elapsed / 1e6);
+	printf("    \"latency_ns\": {\"p50\": %llu, \"p99\": %llu, "
+		"\"p99.9\": %llu, \"max\": %llu}\n",
+		(unsigned long long)percentile(r, 0.5),
+		(unsigned long long)percentile(r, 0.99),
+		(unsigned long long)percentile(r, 0.999),
+		(unsigned long long)(r->nr_lat ? r->lat[r->nr_lat - 1].ns : 0));
+	printf("  }%s\n", last ? "" : ",");
+}
+
+/* Parse a cpu list such as "0-3,8,10-11" */
+static int parse_cpus(const char *list)
+{
+	char *copy = strdup(list);
+	char *token;
+	char *save = NULL;
+	int first;
+	int last;
+	int cpu;
+
+	if (!copy) {
+		return -1;
+	}
+
+	for (token = strtok_r(copy, ",", &save); token;
+		token = strtok_r(NULL, ",", &save)) {
+		if (2 != sscanf(token, "%d-%d", &first, &last)) {
+			if (1 != sscanf(token, "%d", &first)) {
+				free(copy);
+				return -1;
+			}
+			last = first;
+		}
+		for (cpu = first; cpu <= last; cpu++) {
+			config.cpus = realloc(config.cpus,
+				(config.nr_cpus + 1) * sizeof(int));
+			if (!config.cpus) {
+				free(copy);
+				return -1;
+			}
+			config.cpus[config.nr_cpus++] = cpu;
+		}
+	}
+
+	free(copy);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-d device] [-r readers] [-w writers] [-s size]\n"
+		"          [-t seconds] [-c cpulist] [-l samples] [-n] [-p]\n"
+		"  -n  open the device with O_NONBLOCK, EAGAIN is counted\n"
+		"  -p  give every thread its own offset instead of 0\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_thread *threads;
+	struct bench_result reads;
+	struct bench_result writes;
+	uint64_t start;
+	double elapsed;
+	struct sigaction sa;
+	struct timespec deadline;
+	int nr;
+	int opt;
+	int flags;
+	int i;
+
+	while (-1 != (opt = getopt(argc, argv, "d:r:w:s:t:c:l:nph"))) {
+		switch (opt) {
+		case 'd':
+			config.device = optarg;
+			break;
+		case 'r':
+			config.readers = atoi(optarg);
+			break;
+		case 'w':
+			config.writers = atoi(optarg);
+			break;
+		case 's':
+			config.size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			config.seconds = atoi(optarg);
+			break;
+		case 'c':
+			if (parse_cpus(optarg)) {
+				fprintf(stderr, "Bad cpu list %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'l':
+			config.samples = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			config.nonblock = 1;
+			break;
+		case 'p':
+			config.partition = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	nr = config.readers + config.writers;
+	if (0 >= nr || 0 > config.readers || 0 > config.writers ||
+		!config.size || 0 >= config.seconds || !config.samples) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	threads = calloc(nr, sizeof(*threads));
+	if (!threads) {
+		perror("calloc()");
+		return -1;
+	}
+
+	/* No SA_RESTART, so a blocking read or write returns EINTR */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = wakeup_handler;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	pthread_barrier_init(&start_barrier, NULL, nr + 1);
+	for (i = 0; i < nr; i++) {
+		threads[i].id = i;
+		threads[i].writer = i >= config.readers;
+		threads[i].cpu = config.nr_cpus ?
+			config.cpus[i % config.nr_cpus] : -1;
+		threads[i].seed = i + 1;
+		threads[i].lat = malloc(config.samples * sizeof(uint64_t));
+		threads[i].buffer = malloc(config.size);
+		if (!threads[i].lat || !threads[i].buffer) {
+			perror("malloc()");
+			return -1;
+		}
+		memset(threads[i].buffer, 'a' + i % 26, config.size);
+
+		/* A run missing some of its threads measures nothing useful */
+		flags = threads[i].writer ? O_WRONLY : O_RDONLY;
+		if (config.nonblock) {
+			flags |= O_NONBLOCK;
+		}
+		threads[i].fd = open(config.device, flags);
+		if (0 > threads[i].fd) {
+			fprintf(stderr, "Cannot open %s for thread %d: %s\n",
+				config.device, i, strerror(errno));
+			return -1;
+		}
+
+		if (pthread_create(&threads[i].thread, NULL, bench_worker,
+			&threads[i])) {
+			perror("pthread_create()");
+			return -1;
+		}
+	}
+
+	pthread_barrier_wait(&start_barrier);
+	start = now_ns();
+	sleep(config.seconds);
+	running = 0;
+
+	for (i = 0; i < nr; i++) {
+		do {
+			pthread_kill(threads[i].thread, SIGUSR1);
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += 100000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+		} while (ETIMEDOUT == pthread_timedjoin_np(threads[i].thread,
+			NULL, &deadline));
+	}
+	elapsed = (now_ns() - start) / 1e9;
+
+	if (collect(threads, nr, 0, &reads) ||
+		collect(threads, nr, 1, &writes)) {
+		perror("malloc()");
+		return -1;
+	}
+
+	printf("{\n");
+	printf("  \"device\": \"%s\",\n", config.device);
+	printf("  \"readers\": %d,\n", config.readers);
+	printf("  \"writers\": %d,\n", config.writers);
+	printf("  \"size\": %zu,\n", config.size);
+	printf("  \"nonblock\": %s,\n", config.nonblock ? "true" : "false");
+	printf("  \"partition\": %s,\n", config.partition ? "true" : "false");
+	printf("  \"seconds\": %.3f,\n", elapsed);
+	print_result("read", &reads, elapsed, 0);
+	print_result("write", &writes, elapsed, 1);
+	printf("}\n");
+
+	for (i = 0; i < nr; i++) {
+		close(threads[i].fd);
+		free(threads[i].buffer);
+		free(threads[i].lat);
+	}
+	free(reads.lat);
+	free(writes.lat);
+	free(threads);
+	free(config.cpus);
+	pthread_barrier_destroy(&start_barrier);
+
+	return 0;
+}
@@ -7,6 +7,8 @@
 #elif EPOLL
 #include <sys/epoll.h>
 #include <strings.h>
+#elif MMAP
+#include <sys/mman.h>
 #endif
 
 int main(int argc, char *argv[])
@@ -93,6 +95,17 @@ int main(int argc, char *argv[])
 	printf("Read the content from device with :%s, %d\n", buffer, lenth);
 	lenth = read(fd, buffer, 1024);
 	printf("Read the content from device with :%s, %d\n", buffer, lenth);
+#elif MMAP
+	char *buffer;
+
+	buffer = mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == buffer) {
+		perror("mmap()");
+		close(fd);
+		return -1;
+	}
+	printf("Read the content from mapping with :%s\n", buffer);
+	munmap(buffer, 4096);
 #elif CLEAR
 	if (0 > ioctl(fd, 0x1)) {
 		printf("Cannot clean the device content\n");
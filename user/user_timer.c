@@ -5,21 +5,18 @@
 int main(int argc, char *argv[])
 {
 	int fd;
-	int counter = 0;
-	int old_counter = 0;
+	unsigned int ticks = 0;
+	unsigned int counter = 0;
 
 	fd = open("/dev/awcloud0", O_RDONLY);
 	if (0 > fd) {
 		printf("Cannot open the device\n");
 		return -1;
 	}
-	while (1) {
-		read(fd, &counter, sizeof(unsigned int));
-		if (counter != old_counter) {
-			printf("seconds after open devices:%d\n",
-				counter);
-			old_counter = counter;
-		}
+	/* Each read sleeps until the next tick and returns the ticks since */
+	while (sizeof(ticks) == read(fd, &ticks, sizeof(ticks))) {
+		counter += ticks;
+		printf("seconds after open devices:%u\n", counter);
 	}
 
 	close(fd);